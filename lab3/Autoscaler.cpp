@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "Autoscaler.h"
+#include "sthread.h"
+
+using namespace std;
+
+Autoscaler::
+Autoscaler(double growTasksPerWorker, double shrinkTasksPerWorker)
+    : growDepth(growTasksPerWorker), shrinkDepth(shrinkTasksPerWorker),
+      startNs(sthread_time_ns())
+{
+    assert(growDepth > 0 && shrinkDepth < growDepth);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * addGroup --
+ *
+ *      Add a group of workers that may have minWorkers to
+ *      maxWorkers workers and starts with initialWorkers, brought
+ *      within those bounds.
+ *
+ * Results:
+ *      The index of the group, to pass to sample.
+ *
+ * ------------------------------------------------------------------
+ */
+int Autoscaler::
+addGroup(const char* name, int minWorkers, int maxWorkers, int initialWorkers)
+{
+    assert(minWorkers > 0 && minWorkers <= maxWorkers);
+
+    Group group;
+    group.name          = name;
+    group.minWorkers    = minWorkers;
+    group.maxWorkers    = maxWorkers;
+    group.target        = max(minWorkers, min(maxWorkers, initialWorkers));
+    group.idleSamples   = 0;
+    group.lastCompleted = 0;
+    group.lastSampleNs  = startNs;
+    groups.push_back(group);
+    return groups.size() - 1;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * sample --
+ *
+ *      Take a sample of group: depth tasks queued, waiting of its
+ *      workers blocked in the store, and completed tasks run by the
+ *      group so far. Pick the group's new worker count as described
+ *      in Autoscaler and log it if it changed.
+ *
+ * Results:
+ *      The number of workers the group should have.
+ *
+ * ------------------------------------------------------------------
+ */
+int Autoscaler::
+sample(int index, long depth, long waiting, long completed)
+{
+    Group& group = groups[index];
+    long long now = sthread_time_ns();
+    double tasksPerSec = 0;
+    if (now > group.lastSampleNs)
+        tasksPerSec = (completed - group.lastCompleted) * 1e9 /
+                      (now - group.lastSampleNs);
+    group.lastCompleted = completed;
+    group.lastSampleNs  = now;
+
+    int from = group.target;
+    int to = from;
+    long serving = max(from - waiting, 1L);
+    int floor = max((long) group.minWorkers,
+                    min((long) group.maxWorkers, waiting + 1));
+
+    if (depth > growDepth * serving) {
+        group.idleSamples = 0;
+        long wanted = waiting + (long) ceil(depth / growDepth);
+        to = min((long) group.maxWorkers, max(wanted, (long) from));
+    } else if (depth <= shrinkDepth * from && from > floor) {
+        if (++group.idleSamples >= SHRINK_IDLE_SAMPLES) {
+            group.idleSamples = 0;
+            to = from - 1;
+        }
+    } else {
+        group.idleSamples = 0;
+    }
+
+    if (to != from) {
+        ScalingDecision decision;
+        decision.timeNs      = now - startNs;
+        decision.group       = index;
+        decision.from        = from;
+        decision.to          = to;
+        decision.depth       = depth;
+        decision.waiting     = waiting;
+        decision.tasksPerSec = tasksPerSec;
+        decisions.push_back(decision);
+        group.target = to;
+    }
+    return to;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * printLog --
+ *
+ *      Print every logged decision to out, oldest first.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Autoscaler::
+printLog(FILE* out) const
+{
+    fprintf(out, "%10s  %-10s %9s %8s %8s %12s\n",
+            "time (ms)", "group", "workers", "depth", "waiting", "tasks/sec");
+    for (const ScalingDecision& d : decisions) {
+        fprintf(out, "%10.3f  %-10s %4d->%-3d %8ld %8ld %12.0f\n",
+                d.timeNs / 1e6, groups[d.group].name, d.from, d.to,
+                d.depth, d.waiting, d.tasksPerSec);
+    }
+}
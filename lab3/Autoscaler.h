@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+// How often the autoscaler samples, and the queue depth per worker
+// above which a group grows and at or below which it may shrink.
+#define DEFAULT_SCALE_PERIOD_NS  10000000LL
+#define DEFAULT_GROW_DEPTH       4.0
+#define DEFAULT_SHRINK_DEPTH     0.5
+
+// The number of samples in a row that must find a group idle before
+// it loses a worker.
+#define SHRINK_IDLE_SAMPLES      5
+
+/*
+ * One change of a group's worker count and what the autoscaler saw
+ * when it made it: the time since the autoscaler started, the queue
+ * depth, the orders blocked in the store, and the group's
+ * throughput, in tasks per second, since the previous sample.
+ */
+struct ScalingDecision {
+    long long timeNs;
+    int group;
+    int from;
+    int to;
+    long depth;
+    long waiting;
+    double tasksPerSec;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * Autoscaler --
+ *
+ *      Decides how many workers each group of workers, such as the
+ *      supplier or the customer threads, should have, from periodic
+ *      samples of the depth of the group's queue and of the number
+ *      of its workers blocked in the store waiting for an order.
+ *
+ *      A blocked worker takes no tasks, so only the others count as
+ *      serving the queue. When the queue holds more than growDepth
+ *      tasks per serving worker the group grows at once to the
+ *      blocked workers plus enough workers for growDepth tasks
+ *      each. When the queue holds at most shrinkDepth tasks per
+ *      worker for SHRINK_IDLE_SAMPLES samples in a row, the group
+ *      shrinks by one worker, but never below one worker more than
+ *      are blocked. Growing fast and shrinking slowly keeps the
+ *      count from oscillating. Counts always stay within the
+ *      group's bounds.
+ *
+ *      Every change is logged with the time it was made. The
+ *      autoscaler only decides; starting and retiring threads is up
+ *      to its caller. It belongs to one thread.
+ *
+ * ------------------------------------------------------------------
+ */
+class Autoscaler {
+    private:
+    struct Group {
+        const char* name;
+        int minWorkers;
+        int maxWorkers;
+        int target;
+        int idleSamples;
+        long lastCompleted;
+        long long lastSampleNs;
+    };
+
+    const double growDepth;
+    const double shrinkDepth;
+    const long long startNs;
+    std::vector<Group> groups;
+    std::vector<ScalingDecision> decisions;
+
+    public:
+    Autoscaler(double growTasksPerWorker = DEFAULT_GROW_DEPTH,
+               double shrinkTasksPerWorker = DEFAULT_SHRINK_DEPTH);
+
+    int addGroup(const char* name, int minWorkers, int maxWorkers,
+                 int initialWorkers);
+    int sample(int group, long depth, long waiting, long completed);
+
+    int target(int group) const { return groups[group].target; }
+    const std::vector<ScalingDecision>& log() const { return decisions; }
+    void printLog(FILE* out) const;
+};
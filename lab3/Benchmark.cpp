@@ -0,0 +1,265 @@
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+
+#include "Benchmark.h"
+#include "RequestGenerator.h"
+#include "RequestHandlers.h"
+
+using namespace std;
+
+/*
+ * ------------------------------------------------------------------
+ * clientMain --
+ *
+ *      The body of a client thread. The argument is a pointer to
+ *      the thread's Client.
+ *
+ *      Generate and run opts.tasksPerClient requests one after the
+ *      other, recording the latency of each, or only counting it in
+ *      lateOps once the store is closing. Every client draws from
+ *      its own random stream, numbered by its index.
+ *
+ * Results:
+ *      NULL.
+ *
+ * ------------------------------------------------------------------
+ */
+void* Benchmark::
+clientMain(void* arg)
+{
+    Client* client = static_cast<Client*>(arg);
+    EStore* store = client->store;
+
+    sutil_random_stream(client->index);
+    SupplierRequestGenerator suppliers(NULL);
+    CustomerRequestGenerator customers(NULL, store->fineModeEnabled());
+    RequestGenerator* generator = &customers;
+    if (client->isSupplier)
+        generator = &suppliers;
+    generator->setItemSpace(client->bench->opts.numItems,
+                            client->bench->opts.sparseIds);
+
+    for (int i = 0; i < client->bench->opts.tasksPerClient; i++) {
+        Task task = generator->nextTask(store);
+        int type = request_type(task.handler);
+        assert(type >= 0);
+
+        auto start = chrono::steady_clock::now();
+        task.handler(task.arg);
+        auto latency = chrono::steady_clock::now() - start;
+
+        if (client->bench->closing.load()) {
+            client->lateOps++;
+            continue;
+        }
+        client->latency[type].record(
+            chrono::duration_cast<chrono::nanoseconds>(latency).count());
+    }
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * runOnce --
+ *
+ *      Run numThreads supplier clients and numThreads customer
+ *      clients against a fresh store and report the throughput up
+ *      to the store closing, the requests completed after that, the
+ *      time spent waiting for store locks, the size of the
+ *      inventory and the latency percentiles of every request type.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Benchmark::
+runOnce(EStoreMode mode, int numThreads)
+{
+    static const char* modeNames[] = { "coarse", "fine", "optimistic" };
+    EStore store(mode, opts.waitForOrders, opts.numItems);
+    vector<Client*> suppliers, customers;
+
+    for (int i = 0; i < 2 * numThreads; i++) {
+        Client* client = new Client();
+        client->bench      = this;
+        client->index      = i;
+        client->store      = &store;
+        client->isSupplier = i < numThreads;
+        client->lateOps    = 0;
+        (client->isSupplier ? suppliers : customers).push_back(client);
+    }
+
+    closing = false;
+    auto start = chrono::steady_clock::now();
+
+    for (Client* client : suppliers)
+        sthread_create(&client->thread, clientMain, client);
+    for (Client* client : customers)
+        sthread_create(&client->thread, clientMain, client);
+
+    for (Client* client : suppliers)
+        sthread_join(client->thread);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    closing = true;
+    store.close();
+    for (Client* client : customers)
+        sthread_join(client->thread);
+
+    LatencyRecorder latency[NUM_REQUEST_TYPES];
+    long ops = 0;
+    long lateOps = 0;
+    for (Client* client : suppliers)
+        for (int k = 0; k < NUM_REQUEST_TYPES; k++)
+            latency[k].merge(client->latency[k]);
+    for (Client* client : customers) {
+        for (int k = 0; k < NUM_REQUEST_TYPES; k++)
+            latency[k].merge(client->latency[k]);
+        lateOps += client->lateOps;
+    }
+    for (int k = 0; k < NUM_REQUEST_TYPES; k++)
+        ops += latency[k].count();
+
+    const EStoreStats& stats = store.getStats();
+    printf("\n%s mode, %d supplier + %d customer threads\n",
+           modeNames[mode], numThreads, numThreads);
+    printf("  ops/sec:         %.0f\n", ops / elapsed.count());
+    printf("  after close:     %ld ops\n", lateOps);
+    printf("  contended locks: %ld\n", stats.contendedLocks.load());
+    printf("  lock wait (ms):  %.3f\n", stats.lockWaitNs.load() / 1e6);
+    printf("  inventory items: %zu (%.0f bytes/item)\n",
+           store.inventorySize(),
+           store.inventorySize() ?
+               (double) store.inventoryMemory() / store.inventorySize() : 0.0);
+    if (mode == OPTIMISTIC_MODE) {
+        long commits = stats.optimisticCommits.load();
+        long aborts = stats.optimisticAborts.load();
+        printf("  stm abort rate:  %.4f (%ld aborts, %ld fallbacks)\n",
+               commits + aborts ? (double) aborts / (commits + aborts) : 0.0,
+               aborts, stats.optimisticFallbacks.load());
+    }
+    printf("  %-16s %8s %10s %10s %10s\n",
+           "request", "count", "p50 (us)", "p99 (us)", "p999 (us)");
+    for (int k = 0; k < NUM_REQUEST_TYPES; k++) {
+        if (latency[k].count() == 0)
+            continue;
+        printf("  %-16s %8ld %10.1f %10.1f %10.1f\n",
+               request_type_name(k), latency[k].count(),
+               latency[k].percentileNs(0.50) / 1e3,
+               latency[k].percentileNs(0.99) / 1e3,
+               latency[k].percentileNs(0.999) / 1e3);
+    }
+
+    for (Client* client : suppliers)
+        delete client;
+    for (Client* client : customers)
+        delete client;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * run --
+ *
+ *      Sweep the thread counts of opts in every store mode.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Benchmark::
+run()
+{
+    for (EStoreMode mode : { COARSE_MODE, FINE_MODE, OPTIMISTIC_MODE })
+        for (int numThreads : opts.threadCounts)
+            runOnce(mode, numThreads);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * layoutClientMain --
+ *
+ *      The body of a layout benchmark thread. The argument is a
+ *      pointer to the thread's LayoutClient.
+ *
+ *      Restock the client's item by one unit and buy it back,
+ *      LAYOUT_BENCH_ROUNDS times. Both write the item's ItemStock.
+ *
+ * Results:
+ *      NULL.
+ *
+ * ------------------------------------------------------------------
+ */
+void* Benchmark::
+layoutClientMain(void* arg)
+{
+    LayoutClient* client = static_cast<LayoutClient*>(arg);
+
+    for (int i = 0; i < LAYOUT_BENCH_ROUNDS; i++) {
+        client->store->addStock(client->item, 1);
+        client->store->buyManyItems(&client->item, 1, MAX_BUDGET);
+    }
+    return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * runLayoutOnce --
+ *
+ *      Run numThreads layout benchmark threads against a fresh
+ *      fine-mode store laid out as layout. The items are added in
+ *      id order, so their ItemStocks are adjacent.
+ *
+ * Results:
+ *      The number of store operations per second.
+ *
+ * ------------------------------------------------------------------
+ */
+double Benchmark::
+runLayoutOnce(InventoryLayout layout, int numThreads)
+{
+    EStore store(FINE_MODE, false, numThreads, layout);
+    vector<LayoutClient> clients(numThreads);
+
+    for (int i = 0; i < numThreads; i++) {
+        clients[i].store = &store;
+        clients[i].item  = i;
+        store.addItem(i, 1, 1.0, 0);
+    }
+
+    auto start = chrono::steady_clock::now();
+    for (LayoutClient& client : clients)
+        sthread_create(&client.thread, layoutClientMain, &client);
+    for (LayoutClient& client : clients)
+        sthread_join(client.thread);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    return 2.0 * LAYOUT_BENCH_ROUNDS * numThreads / elapsed.count();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * runLayouts --
+ *
+ *      Compare the inventory layouts at every thread count of opts.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Benchmark::
+runLayouts()
+{
+    printf("fine mode, one item per thread, %d restock+buy rounds each\n",
+           LAYOUT_BENCH_ROUNDS);
+    printf("  %-8s %14s %14s %8s\n",
+           "threads", "packed ops/s", "padded ops/s", "speedup");
+    for (int numThreads : opts.threadCounts) {
+        double packed = runLayoutOnce(PACKED_LAYOUT, numThreads);
+        double padded = runLayoutOnce(PADDED_LAYOUT, numThreads);
+        printf("  %-8d %14.0f %14.0f %8.2f\n",
+               numThreads, packed, padded, padded / packed);
+    }
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include "EStore.h"
+#include "LatencyRecorder.h"
+#include "sthread.h"
+
+#define DEFAULT_BENCH_TASKS 2000
+
+/*
+ * Number of restock-and-buy rounds each thread of the layout
+ * benchmark runs.
+ */
+#define LAYOUT_BENCH_ROUNDS 200000
+
+/*
+ * ------------------------------------------------------------------
+ * BenchOptions --
+ *
+ *      tasksPerClient is the number of requests each client runs.
+ *      Every entry of threadCounts is one run per EStoreMode with
+ *      that many supplier clients and as many customer clients.
+ *      numItems and sparseIds set the catalog the requests draw
+ *      from, as RequestGenerator::setItemSpace does.
+ *
+ * ------------------------------------------------------------------
+ */
+struct BenchOptions {
+    int tasksPerClient;
+    std::vector<int> threadCounts;
+    bool waitForOrders;
+    ItemId numItems;
+    bool sparseIds;
+
+    BenchOptions()
+        : tasksPerClient(DEFAULT_BENCH_TASKS), threadCounts{1, 2, 4, 8},
+          waitForOrders(false), numItems(INVENTORY_SIZE),
+          sparseIds(false) { }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * Benchmark --
+ *
+ *      A closed-loop throughput benchmark of EStore.
+ *
+ *      Each client thread generates a request with a supplier or
+ *      customer RequestGenerator, runs it to completion itself and
+ *      only then generates the next, so there is no queue and no
+ *      pacing between the generator and the store: the store runs
+ *      as fast as it can serve the clients. Each client records the
+ *      latency of every request by type into its own
+ *      LatencyRecorders, and they are merged when the run ends.
+ *
+ *      As in the simulation, the store is closed once every
+ *      supplier client is done, so that customers still waiting for
+ *      a purchase give up. Requests that complete after that return
+ *      without doing any work, so they are counted apart and left
+ *      out of the throughput and the latencies.
+ *
+ *      runLayouts is a separate microbenchmark of the inventory
+ *      layouts in fine mode. Each thread owns one item, the items
+ *      having consecutive ids, and restocks and buys it in a loop.
+ *      The threads never touch each other's items, so any slowdown
+ *      of PACKED_LAYOUT against PADDED_LAYOUT is false sharing of
+ *      the ItemStocks.
+ *
+ * ------------------------------------------------------------------
+ */
+class Benchmark {
+    private:
+    struct Client {
+        Benchmark* bench;
+        int index;
+        EStore* store;
+        bool isSupplier;
+        sthread_t thread;
+        LatencyRecorder latency[NUM_REQUEST_TYPES];
+        long lateOps;
+    };
+
+    struct LayoutClient {
+        EStore* store;
+        ItemId item;
+        sthread_t thread;
+    };
+
+    const BenchOptions opts;
+    std::atomic<bool> closing;
+
+    static void* clientMain(void* arg);
+    static void* layoutClientMain(void* arg);
+    void runOnce(EStoreMode mode, int numThreads);
+    double runLayoutOnce(InventoryLayout layout, int numThreads);
+
+    public:
+    explicit Benchmark(const BenchOptions& options)
+        : opts(options), closing(false) { }
+
+    void run();
+    void runLayouts();
+};
@@ -0,0 +1,126 @@
+#include <cassert>
+
+#include "Completion.h"
+
+Completion::
+Completion(completion_callback_t onComplete, void* onCompleteContext)
+    : completed(false), callback(onComplete), context(onCompleteContext)
+{
+    smutex_init(&mutex);
+    scond_init(&done);
+    outcome.succeeded   = false;
+    outcome.submittedNs = sthread_time_ns();
+    outcome.startNs     = 0;
+    outcome.finishNs    = 0;
+}
+
+Completion::
+~Completion()
+{
+    scond_destroy(&done);
+    smutex_destroy(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reset --
+ *
+ *      Make the completion ready for another request, submitted
+ *      now. It must not be attached to a request in flight.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Completion::
+reset()
+{
+    smutex_lock(&mutex);
+    completed           = false;
+    outcome.succeeded   = false;
+    outcome.submittedNs = sthread_time_ns();
+    outcome.startNs     = 0;
+    outcome.finishNs    = 0;
+    smutex_unlock(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * complete --
+ *
+ *      Called by a handler once its request, which started running
+ *      at startNs, has finished: record the outcome, then run the
+ *      callback if there is one and otherwise wake the threads
+ *      waiting for the completion. The handler must not touch the
+ *      completion afterwards.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Completion::
+complete(bool succeeded, long long startNs)
+{
+    long long finishNs = sthread_time_ns();
+
+    smutex_lock(&mutex);
+    assert(!completed);
+    outcome.succeeded = succeeded;
+    outcome.startNs   = startNs;
+    outcome.finishNs  = finishNs;
+    completed = true;
+    if (callback == NULL)
+        scond_broadcast(&done, &mutex);
+    smutex_unlock(&mutex);
+
+    if (callback)
+        callback(this, context);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * poll --
+ *
+ *      Check whether the request has completed, without blocking.
+ *
+ * Results:
+ *      True and the outcome in *result if it has.
+ *
+ * ------------------------------------------------------------------
+ */
+bool Completion::
+poll(RequestOutcome* result)
+{
+    smutex_lock(&mutex);
+    bool isDone = completed;
+    if (isDone)
+        *result = outcome;
+    smutex_unlock(&mutex);
+    return isDone;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wait --
+ *
+ *      Block until the request has completed.
+ *
+ * Results:
+ *      The outcome of the request.
+ *
+ * ------------------------------------------------------------------
+ */
+RequestOutcome Completion::
+wait()
+{
+    assert(callback == NULL);
+
+    smutex_lock(&mutex);
+    while (!completed)
+        scond_wait(&done, &mutex);
+    RequestOutcome result = outcome;
+    smutex_unlock(&mutex);
+    return result;
+}
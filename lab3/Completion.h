@@ -0,0 +1,71 @@
+#pragma once
+
+#include "sthread.h"
+
+/*
+ * What became of a request: whether it succeeded, which for a
+ * purchase means that the order was bought, and when, by
+ * sthread_time_ns, it was submitted, started running and finished.
+ * finishNs - startNs includes any time the request spent blocked in
+ * the store waiting for its order.
+ */
+struct RequestOutcome {
+    bool succeeded;
+    long long submittedNs;
+    long long startNs;
+    long long finishNs;
+};
+
+class Completion;
+
+typedef void (*completion_callback_t) (Completion* completion, void* context);
+
+/*
+ * ------------------------------------------------------------------
+ * Completion --
+ *
+ *      The result of one request, delivered asynchronously. A
+ *      client attaches a completion to a request before it enqueues
+ *      the request, and the request's handler completes it once the
+ *      request has run, so that the client needs no thread of its
+ *      own blocked on each request it has in flight.
+ *
+ *      A completion without a callback is a future: the client
+ *      polls it or waits for it, and destroys it once it is done.
+ *      A completion with a callback instead calls it, with context,
+ *      on the thread that ran the request, and is then the
+ *      callback's to destroy or reuse; nobody may wait for it. A
+ *      callback may, for instance, tally outcomes or enqueue the
+ *      next request of a pipeline. It should not block.
+ *
+ *      A completion serves one request at a time. reset makes a
+ *      done completion ready for the next.
+ *
+ * ------------------------------------------------------------------
+ */
+class Completion {
+    private:
+    smutex_t mutex;
+    scond_t done;
+    bool completed;
+    RequestOutcome outcome;
+    completion_callback_t callback;
+    void* context;
+
+    public:
+    explicit Completion(completion_callback_t onComplete = NULL,
+                        void* onCompleteContext = NULL);
+    ~Completion();
+
+    // no default copy constructor and assignment operators. this will prevent some
+    // painful bugs by converting them into compiler errors.
+    Completion(const Completion&) = delete;
+    Completion& operator=(const Completion &) = delete;
+
+    void reset();
+    void complete(bool succeeded, long long startNs);
+
+    bool poll(RequestOutcome* result);
+    RequestOutcome wait();
+    const RequestOutcome& result() const { return outcome; }
+};
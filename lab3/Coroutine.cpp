@@ -0,0 +1,7 @@
+#include "Coroutine.h"
+
+void
+resume_coroutine_handler(void* args)
+{
+    std::coroutine_handle<>::from_address(args).resume();
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+
+/*
+ * Task handler that resumes the suspended coroutine whose handle
+ * address is args. Whoever wakes a suspended coroutine enqueues it
+ * as a task, so that it runs on a worker thread rather than on the
+ * waker's.
+ */
+void resume_coroutine_handler(void* args);
+
+/*
+ * ------------------------------------------------------------------
+ * Purchase --
+ *
+ *      A purchase running as a coroutine (see EStore::buyItemAsync).
+ *      It does not start until a coroutine co_awaits it, which
+ *      suspends the awaiting coroutine until the purchase is
+ *      decided and then evaluates to true if it was bought.
+ *
+ *      While the purchase waits for its order, both it and its
+ *      awaiter stay suspended without holding a thread or a lock;
+ *      whichever worker runs the resume task finishes it. The
+ *      Purchase owns the coroutine and frees it when destroyed, so
+ *      it must outlive the co_await, as a temporary does.
+ *
+ * ------------------------------------------------------------------
+ */
+class Purchase {
+    public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_t;
+
+    /*
+     * Once the purchase is decided, transfer control to its
+     * awaiter instead of returning to whoever resumed it last.
+     */
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(handle_t h) noexcept
+        {
+            return h.promise().awaiter;
+        }
+        void await_resume() noexcept { }
+    };
+
+    struct promise_type {
+        bool bought = false;
+        std::coroutine_handle<> awaiter;
+
+        Purchase get_return_object()
+        {
+            return Purchase(handle_t::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(bool value) { bought = value; }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    private:
+    handle_t coroutine;
+
+    explicit Purchase(handle_t h) : coroutine(h) { }
+
+    public:
+    ~Purchase()
+    {
+        if (coroutine)
+            coroutine.destroy();
+    }
+
+    // no default copy constructor and assignment operators. this will prevent some
+    // painful bugs by converting them into compiler errors.
+    Purchase(const Purchase&) = delete;
+    Purchase& operator=(const Purchase &) = delete;
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        coroutine.promise().awaiter = awaiter;
+        return coroutine;
+    }
+    bool await_resume() { return coroutine.promise().bought; }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * DetachedCoroutine --
+ *
+ *      The return type of a coroutine that nobody awaits, such as
+ *      a request handler that runs a Purchase. It starts running
+ *      at once, returns to its caller the first time it suspends,
+ *      and frees itself when it finishes.
+ *
+ * ------------------------------------------------------------------
+ */
+struct DetachedCoroutine {
+    struct promise_type {
+        DetachedCoroutine get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+    };
+};
@@ -1,30 +1,714 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 
 #include "EStore.h"
 
 using namespace std;
 
 
-Item::
-Item() : valid(false)
-{ }
+Waiter::
+Waiter(TaskSink* sink)
+    : woken(false), priceBound(true), resumeSink(sink), suspended(NULL)
+{
+    smutex_init(&mutex);
+    scond_init(&cond);
+}
+
+Waiter::
+~Waiter()
+{
+    scond_destroy(&cond);
+    smutex_destroy(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wake --
+ *
+ *      Wake the customer, whose woken the caller has just set
+ *      holding the lock that protects it: signal cond, which is
+ *      used with condMutex, or if the purchase is a coroutine that
+ *      has suspended, enqueue it to be resumed. A coroutine that
+ *      has not suspended yet sees woken and does not.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void Waiter::
+wake(smutex_t* condMutex)
+{
+    if (resumeSink == NULL) {
+        scond_signal(&cond, condMutex);
+        return;
+    }
+    if (suspended != NULL) {
+        resumeSink->enqueue(Task{ resume_coroutine_handler, suspended });
+        suspended = NULL;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * WaiterWoken --
+ *
+ *      Awaited by a coroutine purchase, holding no store lock, to
+ *      suspend until its waiter is woken. If the waiter was woken
+ *      since the purchase let go of the store locks, it does not
+ *      suspend at all.
+ *
+ *      Once the coroutine is saved in the waiter it may be resumed
+ *      on another worker before await_suspend returns, so nothing
+ *      here touches the waiter after releasing its mutex.
+ *
+ * ------------------------------------------------------------------
+ */
+struct WaiterWoken {
+    Waiter* waiter;
+
+    bool await_ready() { return false; }
+    bool await_suspend(coroutine_handle<> purchase)
+    {
+        smutex_lock(&waiter->mutex);
+        bool suspend = !waiter->woken;
+        if (suspend)
+            waiter->suspended = purchase.address();
+        smutex_unlock(&waiter->mutex);
+        return suspend;
+    }
+    void await_resume() { }
+};
+
+
+EStore::
+EStore(EStoreMode storeMode, bool enableWaitForOrders, size_t capacity,
+       InventoryLayout layout)
+    : inventory(capacity, layout), mode(storeMode),
+      fineMode(storeMode != COARSE_MODE),
+      optimistic(storeMode == OPTIMISTIC_MODE),
+      waitForOrders(enableWaitForOrders), pricing(), resumeSink(NULL)
+{
+    pricing.seq.store(0);
+    pricing.shippingCost.store(3);
+    pricing.storeDiscount.store(0);
+    pricing.closed.store(false);
+
+    smutex_init(&mutex);
+
+    size_t numStripes = MIN_LOCK_STRIPES;
+    while (numStripes < capacity && numStripes < MAX_LOCK_STRIPES)
+        numStripes <<= 1;
+    stripes = new LockStripe[numStripes];
+    stripeMask = numStripes - 1;
+    for (size_t i = 0; i < numStripes; i++)
+        srwlock_init(&stripes[i].lock, true);
+    srwlock_init(&storeLock, true);
+
+    sthread_profile_name(&mutex, "EStore::mutex");
+    sthread_profile_name(&storeLock, "EStore::storeLock");
+    sthread_profile_name_array(&stripes[0].lock, numStripes,
+                               sizeof(LockStripe), "EStore::stripes");
+}
+
+EStore::
+~EStore()
+{
+    srwlock_destroy(&storeLock);
+    for (size_t i = 0; i <= stripeMask; i++)
+        srwlock_destroy(&stripes[i].lock);
+    delete[] stripes;
+
+    smutex_destroy(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * inventoryMemory --
+ *
+ *      Return the memory held by the inventory and its lock
+ *      stripes.
+ *
+ * Results:
+ *      The size in bytes.
+ *
+ * ------------------------------------------------------------------
+ */
+size_t EStore::
+inventoryMemory()
+{
+    return inventory.memoryUsed() + (stripeMask + 1) * sizeof(LockStripe);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * stripeOf --
+ *
+ *      Return the index of the lock stripe item_id hashes to.
+ *
+ * Results:
+ *      The stripe index.
+ *
+ * ------------------------------------------------------------------
+ */
+size_t EStore::
+stripeOf(ItemId item_id) const
+{
+    return fold_item_id(item_id) & stripeMask;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockItem --
+ *
+ *      Acquire the lock that protects the inventory entry of
+ *      item_id, to change it: the store mutex in coarse mode, the
+ *      item's stripe, for writing, in fine mode.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+lockItem(ItemId item_id)
+{
+    if (fineMode)
+        acquire(&stripes[stripeOf(item_id)].lock);
+    else
+        acquire(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlockItem --
+ *
+ *      Release the lock taken by lockItem.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+unlockItem(ItemId item_id)
+{
+    if (fineMode)
+        srwlock_wrunlock(&stripes[stripeOf(item_id)].lock);
+    else
+        smutex_unlock(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockStore --
+ *
+ *      Acquire the lock that protects the shipping cost, the store
+ *      discount and the store-wide wait list, to change them.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+lockStore()
+{
+    if (fineMode)
+        acquire(&storeLock);
+    else
+        acquire(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlockStore --
+ *
+ *      Release the lock taken by lockStore.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+unlockStore()
+{
+    if (fineMode)
+        srwlock_wrunlock(&storeLock);
+    else
+        smutex_unlock(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * acquire --
+ *
+ *      Lock one of the store's locks. If another thread holds it,
+ *      count the acquire as contended and add the time spent
+ *      waiting for it to the lock-wait statistics.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+acquire(smutex_t* lock)
+{
+    if (smutex_trylock(lock))
+        return;
+
+    auto start = chrono::steady_clock::now();
+    smutex_lock(lock);
+    auto waited = chrono::steady_clock::now() - start;
+
+    stats.contendedLocks.fetch_add(1, memory_order_relaxed);
+    stats.lockWaitNs.fetch_add(
+        chrono::duration_cast<chrono::nanoseconds>(waited).count(),
+        memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * acquire --
+ *
+ *      Lock one of the store's reader-writer locks, for reading if
+ *      shared is set and for writing otherwise, with the same
+ *      accounting as for a mutex.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+acquire(srwlock_t* lock, bool shared)
+{
+    if (shared ? srwlock_tryrdlock(lock) : srwlock_trywrlock(lock))
+        return;
+
+    auto start = chrono::steady_clock::now();
+    if (shared)
+        srwlock_rdlock(lock);
+    else
+        srwlock_wrlock(lock);
+    auto waited = chrono::steady_clock::now() - start;
+
+    stats.contendedLocks.fetch_add(1, memory_order_relaxed);
+    stats.lockWaitNs.fetch_add(
+        chrono::duration_cast<chrono::nanoseconds>(waited).count(),
+        memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * readPricing --
+ *
+ *      Take a consistent snapshot of the store-wide pricing fields
+ *      without locking. See StorePricing.
+ *
+ * Results:
+ *      The snapshot.
+ *
+ * ------------------------------------------------------------------
+ */
+PricingSnapshot EStore::
+readPricing() const
+{
+    PricingSnapshot snapshot;
+    while (true) {
+        snapshot.version = pricing.seq.load(memory_order_acquire);
+        if (snapshot.version & 1)
+            continue;
+        snapshot.shippingCost  =
+            pricing.shippingCost.load(memory_order_relaxed);
+        snapshot.storeDiscount =
+            pricing.storeDiscount.load(memory_order_relaxed);
+        snapshot.closed = pricing.closed.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (pricing.seq.load(memory_order_relaxed) == snapshot.version)
+            return snapshot;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * pricingCurrent --
+ *
+ *      Check that no pricing field has changed since snapshot was
+ *      taken.
+ *
+ * Results:
+ *      True if snapshot still describes the store.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+pricingCurrent(const PricingSnapshot& snapshot) const
+{
+    return pricing.seq.load() == snapshot.version;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * beginPricingUpdate --
+ *
+ *      Start changing the pricing fields: make seq odd so that
+ *      readers retry. The caller must hold the store lock, and
+ *      must call endPricingUpdate once the fields are written.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+beginPricingUpdate()
+{
+    pricing.seq.store(pricing.seq.load(memory_order_relaxed) + 1,
+                      memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * endPricingUpdate --
+ *
+ *      Publish the new pricing fields.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+endPricingUpdate()
+{
+    pricing.seq.store(pricing.seq.load(memory_order_relaxed) + 1,
+                      memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * itemCost --
+ *
+ *      Compute the cost of buying one unit of an item at unitPrice,
+ *      including shipping, given the store discount and shipping
+ *      cost.
+ *
+ * Results:
+ *      The cost of the item.
+ *
+ * ------------------------------------------------------------------
+ */
+double EStore::
+itemCost(double unitPrice, double discount, double shipping) const
+{
+    return unitPrice * (1 - discount) + shipping;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * cachedCost --
+ *
+ *      Return the cost of one unit of the item copy was taken from,
+ *      under the pricing of snapshot: the cached cost if it is
+ *      current, otherwise a freshly computed one, which is not
+ *      cached since the caller holds no lock.
+ *
+ * Results:
+ *      The cost of the item.
+ *
+ * ------------------------------------------------------------------
+ */
+double EStore::
+cachedCost(const StockCopy& copy, const PricingSnapshot& snapshot) const
+{
+    if (copy.costSeq == snapshot.version)
+        return copy.unitCost;
+    return itemCost(copy.unitPrice, snapshot.storeDiscount,
+                    snapshot.shippingCost);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * refreshCost --
+ *
+ *      Make the cached unit cost of stock current for the pricing
+ *      of snapshot, unless it already is. The caller must hold the
+ *      item's lock and, in optimistic mode, its version, and must
+ *      count a refresh as a change to the item so that optimistic
+ *      readers do not pair the new cost with an old costSeq.
+ *
+ * Results:
+ *      True if the cache was rewritten.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+refreshCost(ItemStock& stock, const PricingSnapshot& snapshot)
+{
+    if (stock.costSeq == snapshot.version)
+        return false;
+    stock.unitCost = itemCost(stock.unitPrice, snapshot.storeDiscount,
+                              snapshot.shippingCost);
+    stock.costSeq = snapshot.version;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockItemVersion --
+ *
+ *      In optimistic mode, make the version of entry odd so that
+ *      the caller may change its item, spinning while another
+ *      thread has it odd. The caller must hold the item's lock.
+ *      A no-op in the other modes.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+lockItemVersion(InventoryEntry* entry)
+{
+    if (!optimistic)
+        return;
+
+    atomic<unsigned long>& version = entry->stock->version;
+    for (int spins = 1; ; spins++) {
+        unsigned long v = version.load(memory_order_relaxed);
+        if (!(v & 1) &&
+            version.compare_exchange_weak(v, v + 1, memory_order_acq_rel))
+            return;
+        if (spins % 64 == 0)
+            sthread_yield();
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlockItemVersion --
+ *
+ *      Undo lockItemVersion. If the item changed, its version moves
+ *      on so that optimistic readers notice; otherwise it goes back
+ *      to the value it had, and readers that overlapped need not
+ *      retry.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+unlockItemVersion(InventoryEntry* entry, bool changed)
+{
+    if (!optimistic)
+        return;
+
+    atomic<unsigned long>& version = entry->stock->version;
+    unsigned long v = version.load(memory_order_relaxed);
+    version.store(changed ? v + 1 : v - 1, memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * readItems --
+ *
+ *      Copy the stock of the order lines into copies, and their
+ *      versions into versions, without locking. Every line must
+ *      have an entry. The copies are only usable if no item was
+ *      being changed and none changed while they were copied.
+ *
+ * Results:
+ *      True if the copies are a consistent snapshot.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+readItems(const OrderLine* lines, int numLines, StockCopy* copies,
+          unsigned long* versions)
+{
+    for (int i = 0; i < numLines; i++) {
+        const ItemStock& stock = *lines[i].entry->stock;
+        versions[i] = stock.version.load(memory_order_acquire);
+        if (versions[i] & 1)
+            return false;
+
+        __atomic_load(&stock.valid, &copies[i].valid, __ATOMIC_RELAXED);
+        __atomic_load(&stock.quantity, &copies[i].quantity, __ATOMIC_RELAXED);
+        __atomic_load(&stock.unitPrice, &copies[i].unitPrice,
+                      __ATOMIC_RELAXED);
+        __atomic_load(&stock.unitCost, &copies[i].unitCost, __ATOMIC_RELAXED);
+        __atomic_load(&stock.costSeq, &copies[i].costSeq, __ATOMIC_RELAXED);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    for (int i = 0; i < numLines; i++)
+        if (lines[i].entry->stock->version.load(memory_order_relaxed) !=
+            versions[i])
+            return false;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockOrder --
+ *
+ *      Acquire the stripes of every line of an order sorted by
+ *      stripe, taking a stripe shared by several lines only once,
+ *      for reading if shared is set and for writing otherwise.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+lockOrder(const OrderLine* lines, int numLines, bool shared)
+{
+    for (int i = 0; i < numLines; i++)
+        if (i == 0 || lines[i].stripe != lines[i - 1].stripe)
+            acquire(&stripes[lines[i].stripe].lock, shared);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlockOrder --
+ *
+ *      Release the stripes taken by lockOrder, in reverse order.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+unlockOrder(const OrderLine* lines, int numLines, bool shared)
+{
+    for (int i = numLines - 1; i >= 0; i--) {
+        if (i > 0 && lines[i].stripe == lines[i - 1].stripe)
+            continue;
+        if (shared)
+            srwlock_rdunlock(&stripes[lines[i].stripe].lock);
+        else
+            srwlock_wrunlock(&stripes[lines[i].stripe].lock);
+    }
+}
 
-Item::
-~Item()
-{ }
+/*
+ * ------------------------------------------------------------------
+ * addWaiter --
+ *
+ *      Link waiter onto list, keeping the list sorted by decreasing
+ *      maxCost. maxCost is the highest unit cost of the list's item
+ *      at which the waiter could buy; waiters on the store-wide
+ *      list leave it unbounded. The caller must hold the lock that
+ *      protects the list.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+addWaiter(WaitList& list, Waiter* waiter, double maxCost)
+{
+    auto it = list.begin();
+    while (it != list.end() && it->maxCost >= maxCost)
+        it++;
+    list.insert(it, WaitSlot{maxCost, waiter});
+}
 
+/*
+ * ------------------------------------------------------------------
+ * removeWaiter --
+ *
+ *      Unlink waiter from list. The caller must hold the lock that
+ *      protects the list.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+removeWaiter(WaitList& list, Waiter* waiter)
+{
+    auto it = find_if(list.begin(), list.end(),
+                      [waiter](const WaitSlot& slot) {
+                          return slot.waiter == waiter;
+                      });
+    assert(it != list.end());
+    list.erase(it);
+}
 
-EStore::
-EStore(bool enableFineMode)
-    : fineMode(enableFineMode)
+/*
+ * ------------------------------------------------------------------
+ * wakeWaiters --
+ *
+ *      Record a state change and wake the customers on list that
+ *      could buy at cost, the new unit cost of the list's item, so
+ *      that they re-check their purchase. If the change is a price
+ *      drop, only price-bound waiters are woken. By default every
+ *      waiter is woken. Waiters stay on the list until they unlink
+ *      themselves, so a waiter that has already been woken is
+ *      skipped. The caller must hold the lock that protects the
+ *      list.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+wakeWaiters(WaitList& list, double cost, bool priceDrop)
 {
-    // TODO: Your code here.
+    stats.stateChanges.fetch_add(1, memory_order_relaxed);
+
+    for (const WaitSlot& slot : list) {
+        if (slot.maxCost < cost)
+            break;
+        Waiter* waiter = slot.waiter;
+        bool ownMutex = fineMode || waiter->resumeSink != NULL;
+        if (ownMutex)
+            smutex_lock(&waiter->mutex);
+        if (!waiter->woken && (!priceDrop || waiter->priceBound)) {
+            waiter->woken = true;
+            waiter->wake(fineMode ? &waiter->mutex : &mutex);
+            stats.wakeups.fetch_add(1, memory_order_relaxed);
+        }
+        if (ownMutex)
+            smutex_unlock(&waiter->mutex);
+    }
 }
 
-EStore::
-~EStore()
+/*
+ * ------------------------------------------------------------------
+ * markPriceBound --
+ *
+ *      Record that a price rose for every customer on list, which
+ *      may now be unable to afford its purchase. The caller must
+ *      hold the lock that protects the list.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+markPriceBound(WaitList& list)
 {
-    // TODO: Your code here.
+    for (const WaitSlot& slot : list) {
+        if (fineMode)
+            smutex_lock(&slot.waiter->mutex);
+        slot.waiter->priceBound = true;
+        if (fineMode)
+            smutex_unlock(&slot.waiter->mutex);
+    }
 }
 
 /*
@@ -53,16 +737,130 @@ EStore::
  *      discount, plus the flat overall store shipping fee.
  *
  * Results:
- *      None.
+ *      True if the item was bought.
  *
  * ------------------------------------------------------------------
  */
-void EStore::
-buyItem(int item_id, double budget)
+bool EStore::
+buyItem(ItemId item_id, double budget)
 {
     assert(!fineModeEnabled());
 
-    // TODO: Your code here.
+    Waiter waiter;
+    PurchaseStep step = PURCHASE_GIVEN_UP;
+
+    acquire(&mutex);
+    InventoryEntry* entry = inventory.find(item_id);
+    if (entry != NULL)
+        step = tryBuyItem(entry, budget, &waiter, false);
+    while (step == PURCHASE_WAITING) {
+        while (!waiter.woken)
+            scond_wait(&waiter.cond, &mutex);
+        unlistItemWaiter(entry, &waiter);
+        step = tryBuyItem(entry, budget, &waiter, true);
+    }
+    smutex_unlock(&mutex);
+    return step == PURCHASE_BOUGHT;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemAsync --
+ *
+ *      buyItem as a coroutine: while the item cannot be bought, let
+ *      go of the store mutex and suspend, rather than block, until
+ *      a change to the item or the store wakes the purchase.
+ *
+ * Results:
+ *      A Purchase that evaluates to true if the item was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+Purchase EStore::
+buyItemAsync(ItemId item_id, double budget)
+{
+    assert(!fineModeEnabled() && coroutinesEnabled());
+
+    Waiter waiter(resumeSink);
+    PurchaseStep step = PURCHASE_GIVEN_UP;
+
+    acquire(&mutex);
+    InventoryEntry* entry = inventory.find(item_id);
+    if (entry != NULL)
+        step = tryBuyItem(entry, budget, &waiter, false);
+    while (step == PURCHASE_WAITING) {
+        smutex_unlock(&mutex);
+        stats.suspendedPurchases.fetch_add(1, memory_order_relaxed);
+        co_await WaiterWoken{ &waiter };
+        acquire(&mutex);
+        unlistItemWaiter(entry, &waiter);
+        step = tryBuyItem(entry, budget, &waiter, true);
+    }
+    smutex_unlock(&mutex);
+    co_return step == PURCHASE_BOUGHT;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryBuyItem --
+ *
+ *      One attempt of a coarse mode purchase of the item in entry,
+ *      holding the store mutex: buy it, give up because the store
+ *      no longer carries it or is closed, or link waiter onto the
+ *      item's and the store-wide wait lists. wasWoken tells whether
+ *      the purchase was woken from waiting since its last attempt.
+ *
+ * Results:
+ *      Where the purchase stands.
+ *
+ * ------------------------------------------------------------------
+ */
+EStore::PurchaseStep EStore::
+tryBuyItem(InventoryEntry* entry, double budget, Waiter* waiter,
+           bool wasWoken)
+{
+    ItemStock& stock = *entry->stock;
+    if (!stock.valid)
+        return PURCHASE_GIVEN_UP;
+
+    PricingSnapshot snapshot = readPricing();
+    refreshCost(stock, snapshot);
+    if (stock.quantity > 0 && stock.unitCost <= budget) {
+        stock.quantity--;
+        return PURCHASE_BOUGHT;
+    }
+    if (snapshot.closed)
+        return PURCHASE_GIVEN_UP;
+    if (wasWoken)
+        stats.futileWakeups.fetch_add(1, memory_order_relaxed);
+
+    waiter->woken = false;
+    waiter->priceBound = stock.unitCost > budget;
+    addWaiter(entry->waiters, waiter, budget);
+    addWaiter(storeWaiters, waiter);
+    stats.waitingOrders.fetch_add(1, memory_order_relaxed);
+    return PURCHASE_WAITING;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlistItemWaiter --
+ *
+ *      Unlink the woken waiter of a coarse mode purchase of the
+ *      item in entry from the lists tryBuyItem linked it onto. The
+ *      caller must hold the store mutex.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+unlistItemWaiter(InventoryEntry* entry, Waiter* waiter)
+{
+    stats.waitingOrders.fetch_sub(1, memory_order_relaxed);
+    removeWaiter(storeWaiters, waiter);
+    removeWaiter(entry->waiters, waiter);
 }
 
 /*
@@ -73,6 +871,21 @@ buyItem(int item_id, double budget)
  *      order cannot be bought, give up and return without buying
  *      anything. Otherwise buy the entire order at once.
  *
+ *      If the store was created with waitForOrders, an order that
+ *      is out of stock or over budget instead waits, as buyItem
+ *      does, until it can be bought, the store stops carrying one
+ *      of its items or the store is closed. The waiter is only
+ *      woken by changes to the items in its order and to the
+ *      store-wide shipping cost and discount.
+ *
+ *      An order is priced from one snapshot of the shipping cost
+ *      and store discount, read without taking storeLock, and is
+ *      only bought if that snapshot is still current once the items
+ *      have been checked; otherwise it is priced again. Since the
+ *      items are locked throughout, the whole order is bought at
+ *      one shipping cost and store discount that were in effect at
+ *      the moment of purchase.
+ *
  *      The entire order can be bought if:
  *          - The store carries all items.
  *          - All items are in stock.
@@ -106,16 +919,489 @@ buyItem(int item_id, double budget)
  *      order.
  *
  * Results:
+ *      True if the order was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+buyManyItems(const ItemId* item_ids, int numItems, double budget)
+{
+    assert(fineModeEnabled());
+
+    OrderLine lines[MAX_BUY_ITEM];
+    int numLines = prepareOrder(item_ids, numItems, lines);
+
+    bool bought = false;
+    if (optimistic && buyManyItemsOptimistic(lines, numLines, budget, &bought))
+        return bought;
+    return buyManyItemsLocked(lines, numLines, budget);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItemsAsync --
+ *
+ *      buyManyItems as a coroutine: while the order has to wait,
+ *      suspend, rather than block, until a change to the order
+ *      wakes the purchase. The purchase holds no lock while it is
+ *      suspended; it takes its stripes again once resumed. item_ids
+ *      must stay valid until the purchase starts.
+ *
+ * Results:
+ *      A Purchase that evaluates to true if the order was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+Purchase EStore::
+buyManyItemsAsync(const ItemId* item_ids, int numItems, double budget)
+{
+    assert(fineModeEnabled() && coroutinesEnabled());
+
+    OrderLine lines[MAX_BUY_ITEM];
+    int numLines = prepareOrder(item_ids, numItems, lines);
+
+    bool bought = false;
+    if (optimistic && buyManyItemsOptimistic(lines, numLines, budget, &bought))
+        co_return bought;
+
+    Waiter waiter(resumeSink);
+    double shippingCost;
+
+    lockOrder(lines, numLines);
+    if (!findOrder(lines, numLines))
+        co_return false;
+
+    PurchaseStep step = tryBuyOrder(lines, numLines, budget, &waiter, false,
+                                    &shippingCost);
+    while (step == PURCHASE_WAITING) {
+        while (true) {
+            stats.suspendedPurchases.fetch_add(1, memory_order_relaxed);
+            co_await WaiterWoken{ &waiter };
+            if (!rearmWaiter(lines, numLines, budget, &waiter, shippingCost))
+                break;
+            stats.futileWakeups.fetch_add(1, memory_order_relaxed);
+        }
+        unlistOrderWaiter(lines, numLines, &waiter);
+        step = tryBuyOrder(lines, numLines, budget, &waiter, true,
+                           &shippingCost);
+    }
+    co_return step == PURCHASE_BOUGHT;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * prepareOrder --
+ *
+ *      Turn the numItems ids of an order into lines, one for each
+ *      distinct item, sorted by stripe. Their entries are left to
+ *      be looked up.
+ *
+ * Results:
+ *      The number of lines.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::
+prepareOrder(const ItemId* item_ids, int numItems, OrderLine* lines)
+{
+    assert(numItems >= 0 && numItems <= MAX_BUY_ITEM);
+
+    // Merge repeated ids into one line each.
+    int numLines = 0;
+    for (int i = 0; i < numItems; i++) {
+        OrderLine* line = lines;
+        while (line < lines + numLines && line->id != item_ids[i])
+            line++;
+        if (line == lines + numLines) {
+            line->id     = item_ids[i];
+            line->wanted = 0;
+            line->stripe = stripeOf(item_ids[i]);
+            line->entry  = NULL;
+            numLines++;
+        }
+        line->wanted++;
+    }
+
+    // Take the stripes in increasing order so that two overlapping
+    // orders can never deadlock.
+    sort(lines, lines + numLines,
+         [](const OrderLine& a, const OrderLine& b) {
+             return a.stripe != b.stripe ? a.stripe < b.stripe : a.id < b.id;
+         });
+    return numLines;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * findOrder --
+ *
+ *      Look up the entries of the items of an order whose stripes
+ *      the caller holds for writing. If the store never carried one
+ *      of them, release the stripes.
+ *
+ * Results:
+ *      True if every item was found, false if the order must be
+ *      given up.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+findOrder(OrderLine* lines, int numLines)
+{
+    for (int i = 0; i < numLines; i++) {
+        if (lines[i].entry == NULL)
+            lines[i].entry = inventory.find(lines[i].id);
+        if (lines[i].entry == NULL) {
+            unlockOrder(lines, numLines);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItemsOptimistic --
+ *
+ *      Try to settle an order without taking any lock: either buy
+ *      it, or find that it cannot be bought and must be given up.
+ *      lines are the distinct items of the order, sorted by stripe;
+ *      their entries are filled in.
+ *
+ *      Each attempt reads a consistent snapshot of the pricing and
+ *      of every item in the order and decides from it. To buy, it
+ *      then moves the version of every item from the value it read
+ *      to odd, which fails if any item changed in the meantime,
+ *      updates the stock and publishes new versions. A conflict
+ *      aborts the attempt and the next attempt starts over.
+ *
+ *      An order that has to wait, or that conflicted on
+ *      MAX_OPTIMISTIC_ATTEMPTS attempts, is left to
+ *      buyManyItemsLocked.
+ *
+ * Results:
+ *      True if the order was settled, with *bought set if it was
+ *      bought, or false if the caller must take the item locks.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+buyManyItemsOptimistic(OrderLine* lines, int numLines, double budget,
+                       bool* bought)
+{
+    StockCopy copies[MAX_BUY_ITEM];
+    unsigned long versions[MAX_BUY_ITEM];
+
+    for (int i = 0; i < numLines; i++) {
+        lines[i].entry = inventory.find(lines[i].id);
+        if (lines[i].entry == NULL)
+            return true;
+    }
+
+    for (int attempt = 0; attempt < MAX_OPTIMISTIC_ATTEMPTS; attempt++) {
+        if (attempt > 0)
+            stats.optimisticAborts.fetch_add(1, memory_order_relaxed);
+
+        PricingSnapshot snapshot = readPricing();
+        if (!readItems(lines, numLines, copies, versions))
+            continue;
+
+        bool carried = true;
+        bool buyable = true;
+        double total = 0;
+        for (int i = 0; i < numLines; i++) {
+            if (!copies[i].valid) {
+                carried = false;
+                break;
+            }
+            if (copies[i].quantity < lines[i].wanted)
+                buyable = false;
+            total += lines[i].wanted * cachedCost(copies[i], snapshot);
+        }
+
+        if (!carried)
+            return true;
+        if (!buyable || total > budget)
+            return !waitForOrders || snapshot.closed;
+
+        int locked = 0;
+        while (locked < numLines) {
+            unsigned long expected = versions[locked];
+            if (!lines[locked].entry->stock->version.compare_exchange_strong(
+                    expected, expected + 1, memory_order_acq_rel))
+                break;
+            locked++;
+        }
+
+        if (locked < numLines || !pricingCurrent(snapshot)) {
+            for (int i = 0; i < locked; i++)
+                lines[i].entry->stock->version.store(versions[i],
+                                                     memory_order_release);
+            continue;
+        }
+
+        for (int i = 0; i < numLines; i++) {
+            ItemStock& stock = *lines[i].entry->stock;
+            stock.quantity -= lines[i].wanted;
+            stock.version.store(versions[i] + 2, memory_order_release);
+        }
+
+        stats.optimisticCommits.fetch_add(1, memory_order_relaxed);
+        *bought = true;
+        return true;
+    }
+
+    stats.optimisticAborts.fetch_add(1, memory_order_relaxed);
+    stats.optimisticFallbacks.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItemsLocked --
+ *
+ *      The locking implementation of buyManyItems: hold the stripes
+ *      of every item in the order, in increasing stripe order, while
+ *      checking and buying it, and wait for a change to the order
+ *      if it cannot be bought yet. lines are the distinct items of
+ *      the order, sorted by stripe.
+ *
+ *      Items are looked up under their stripes, so an item the
+ *      store has never carried cannot be added while the order is
+ *      being decided.
+ *
+ *      In optimistic mode the item versions are taken as well
+ *      while the items are checked, since optimistic buyers change
+ *      stock without the item locks.
+ *
+ * Results:
+ *      True if the order was bought.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+buyManyItemsLocked(OrderLine* lines, int numLines, double budget)
+{
+    Waiter waiter;
+    double shippingCost;
+
+    lockOrder(lines, numLines);
+    if (!findOrder(lines, numLines))
+        return false;
+
+    PurchaseStep step = tryBuyOrder(lines, numLines, budget, &waiter, false,
+                                    &shippingCost);
+    while (step == PURCHASE_WAITING) {
+        while (true) {
+            smutex_lock(&waiter.mutex);
+            while (!waiter.woken)
+                scond_wait(&waiter.cond, &waiter.mutex);
+            smutex_unlock(&waiter.mutex);
+            if (!rearmWaiter(lines, numLines, budget, &waiter, shippingCost))
+                break;
+            stats.futileWakeups.fetch_add(1, memory_order_relaxed);
+        }
+        unlistOrderWaiter(lines, numLines, &waiter);
+        step = tryBuyOrder(lines, numLines, budget, &waiter, true,
+                           &shippingCost);
+    }
+    return step == PURCHASE_BOUGHT;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryBuyOrder --
+ *
+ *      Decide an order whose stripes the caller holds for writing
+ *      and whose entries have been looked up: buy it, give it up,
+ *      or link waiter onto the wait lists of its items and the
+ *      store-wide list, with *shippingCost set to the shipping cost
+ *      the item bounds were computed from. wasWoken tells whether
+ *      the order was woken from waiting since its last attempt.
+ *
+ *      Either way the stripes are released on return.
+ *
+ * Results:
+ *      Where the order stands.
+ *
+ * ------------------------------------------------------------------
+ */
+EStore::PurchaseStep EStore::
+tryBuyOrder(OrderLine* lines, int numLines, double budget, Waiter* waiter,
+            bool wasWoken, double* shippingCost)
+{
+    bool bought = false;
+    while (true) {
+        PricingSnapshot snapshot = readPricing();
+        bool refreshed[MAX_BUY_ITEM] = { };
+
+        for (int i = 0; i < numLines; i++)
+            lockItemVersion(lines[i].entry);
+
+        bool carried = true;
+        bool inStock = true;
+        double total = 0;
+        for (int i = 0; i < numLines; i++) {
+            ItemStock& stock = *lines[i].entry->stock;
+            if (!stock.valid) {
+                carried = false;
+                break;
+            }
+            if (stock.quantity < lines[i].wanted)
+                inStock = false;
+            refreshed[i] = refreshCost(stock, snapshot);
+            total += lines[i].wanted * stock.unitCost;
+        }
+
+        bool affordable = carried && inStock && total <= budget;
+        if (affordable && pricingCurrent(snapshot)) {
+            for (int i = 0; i < numLines; i++)
+                lines[i].entry->stock->quantity -= lines[i].wanted;
+            bought = true;
+        }
+        for (int i = numLines - 1; i >= 0; i--)
+            unlockItemVersion(lines[i].entry, bought || refreshed[i]);
+
+        if (bought) {
+            unlockOrder(lines, numLines);
+            return PURCHASE_BOUGHT;
+        }
+        if (affordable) {
+            // The pricing changed under the order; price it again.
+            wasWoken = false;
+            continue;
+        }
+        if (!carried || !waitForOrders || snapshot.closed) {
+            unlockOrder(lines, numLines);
+            return PURCHASE_GIVEN_UP;
+        }
+        if (wasWoken)
+            stats.futileWakeups.fetch_add(1, memory_order_relaxed);
+
+        // Register on the store-wide list first, checking that the
+        // store-wide fields did not change since the snapshot above;
+        // otherwise that change could have been missed.
+        //
+        // On each item the order waits with the highest unit cost
+        // of that item it could afford, given that every other unit
+        // costs at least the shipping. An increase of the shipping
+        // only raises the bound on the other units, and a decrease
+        // wakes the order anyway.
+        waiter->woken = false;
+        waiter->priceBound = total > budget;
+        acquire(&storeLock);
+        if (!pricingCurrent(snapshot)) {
+            srwlock_wrunlock(&storeLock);
+            wasWoken = false;
+            continue;
+        }
+        addWaiter(storeWaiters, waiter);
+        srwlock_wrunlock(&storeLock);
+        stats.waitingOrders.fetch_add(1, memory_order_relaxed);
+        int numUnits = 0;
+        for (int i = 0; i < numLines; i++)
+            numUnits += lines[i].wanted;
+        for (int i = 0; i < numLines; i++) {
+            double others =
+                (numUnits - lines[i].wanted) * snapshot.shippingCost;
+            addWaiter(lines[i].entry->waiters, waiter,
+                      (budget - others) / lines[i].wanted);
+        }
+
+        unlockOrder(lines, numLines);
+        *shippingCost = snapshot.shippingCost;
+        return PURCHASE_WAITING;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlistOrderWaiter --
+ *
+ *      Unlink the woken waiter of an order from the lists
+ *      tryBuyOrder linked it onto, taking the order's stripes for
+ *      writing. The stripes are still held on return.
+ *
+ * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
 void EStore::
-buyManyItems(vector<int>* item_ids, double budget)
+unlistOrderWaiter(const OrderLine* lines, int numLines, Waiter* waiter)
 {
-    assert(fineModeEnabled());
+    stats.waitingOrders.fetch_sub(1, memory_order_relaxed);
+    lockOrder(lines, numLines);
+
+    for (int i = 0; i < numLines; i++)
+        removeWaiter(lines[i].entry->waiters, waiter);
+    acquire(&storeLock);
+    removeWaiter(storeWaiters, waiter);
+    srwlock_wrunlock(&storeLock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * rearmWaiter --
+ *
+ *      Re-check a waiting order that has been woken, holding its
+ *      stripes and storeLock only for reading, and if it still can
+ *      neither be bought nor given up, reset waiter so that it
+ *      sleeps again. waiter stays on the wait lists it was added to
+ *      when the shipping cost was shippingCost.
+ *
+ *      The read locks keep out every change that could wake the
+ *      order while it is re-checked, so none can be missed. The
+ *      item bounds waiter is listed with depend on the shipping
+ *      cost, so if that changed the order must be listed afresh.
+ *      In optimistic mode other orders may still take stock under
+ *      the read locks; that never lets a waiting order buy.
+ *
+ * Results:
+ *      True if waiter must sleep again, false if the caller must
+ *      take the stripes for writing and decide the order.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+rearmWaiter(const OrderLine* lines, int numLines, double budget,
+            Waiter* waiter, double shippingCost)
+{
+    StockCopy copies[MAX_BUY_ITEM];
+    unsigned long versions[MAX_BUY_ITEM];
+    bool waiting = false;
+
+    lockOrder(lines, numLines, true);
+    PricingSnapshot snapshot = readPricing();
+    if (!snapshot.closed && snapshot.shippingCost == shippingCost &&
+        readItems(lines, numLines, copies, versions)) {
+        bool carried = true;
+        bool inStock = true;
+        double total = 0;
+        for (int i = 0; i < numLines; i++) {
+            if (!copies[i].valid) {
+                carried = false;
+                break;
+            }
+            if (copies[i].quantity < lines[i].wanted)
+                inStock = false;
+            total += lines[i].wanted * cachedCost(copies[i], snapshot);
+        }
 
-    // TODO: Your code here.
+        if (carried && !(inStock && total <= budget)) {
+            acquire(&storeLock, true);
+            if (pricingCurrent(snapshot)) {
+                smutex_lock(&waiter->mutex);
+                waiter->woken = false;
+                waiter->priceBound = total > budget;
+                smutex_unlock(&waiter->mutex);
+                waiting = true;
+            }
+            srwlock_rdunlock(&storeLock);
+        }
+    }
+    unlockOrder(lines, numLines, true);
+    return waiting;
 }
 
 /*
@@ -132,9 +1418,25 @@ buyManyItems(vector<int>* item_ids, double budget)
  * ------------------------------------------------------------------
  */
 void EStore::
-addItem(int item_id, int quantity, double price, double discount)
+addItem(ItemId item_id, int quantity, double price, double discount)
 {
-    // TODO: Your code here.
+    lockItem(item_id);
+    InventoryEntry* entry = inventory.find(item_id);
+    if (entry == NULL)
+        entry = inventory.insert(item_id);
+    ItemStock& stock = *entry->stock;
+    if (!stock.valid) {
+        lockItemVersion(entry);
+        entry->item.price    = price;
+        entry->item.discount = discount;
+        stock.valid     = true;
+        stock.quantity  = quantity;
+        stock.unitPrice = price * (1 - discount);
+        stock.costSeq   = 1;
+        refreshCost(stock, readPricing());
+        unlockItemVersion(entry, true);
+    }
+    unlockItem(item_id);
 }
 
 /*
@@ -153,9 +1455,17 @@ addItem(int item_id, int quantity, double price, double discount)
  * ------------------------------------------------------------------
  */
 void EStore::
-removeItem(int item_id)
+removeItem(ItemId item_id)
 {
-    // TODO: Your code here.
+    lockItem(item_id);
+    InventoryEntry* entry = inventory.find(item_id);
+    if (entry != NULL && entry->stock->valid) {
+        lockItemVersion(entry);
+        entry->stock->valid = false;
+        unlockItemVersion(entry, true);
+        wakeWaiters(entry->waiters);
+    }
+    unlockItem(item_id);
 }
 
 /*
@@ -163,7 +1473,8 @@ removeItem(int item_id)
  * addStock --
  *
  *      Increase the stock of the specified item by count. If the
- *      store does not carry the item, do nothing. Wake any waiters.
+ *      store does not carry the item, do nothing. Wake the waiters
+ *      that can afford the item at its current cost.
  *
  * Results:
  *      None.
@@ -171,9 +1482,19 @@ removeItem(int item_id)
  * ------------------------------------------------------------------
  */
 void EStore::
-addStock(int item_id, int count)
+addStock(ItemId item_id, int count)
 {
-    // TODO: Your code here.
+    lockItem(item_id);
+    InventoryEntry* entry = inventory.find(item_id);
+    if (entry != NULL && entry->stock->valid) {
+        ItemStock& stock = *entry->stock;
+        lockItemVersion(entry);
+        stock.quantity += count;
+        refreshCost(stock, readPricing());
+        unlockItemVersion(entry, true);
+        wakeWaiters(entry->waiters, stock.unitCost);
+    }
+    unlockItem(item_id);
 }
 
 /*
@@ -183,7 +1504,8 @@ addStock(int item_id, int count)
  *      Change the price on the item. If the store does not carry
  *      the item, do nothing.
  *
- *      If the item price decreased, wake any waiters.
+ *      If the item price decreased, wake the waiters that can now
+ *      afford it.
  *
  * Results:
  *      None.
@@ -191,9 +1513,26 @@ addStock(int item_id, int count)
  * ------------------------------------------------------------------
  */
 void EStore::
-priceItem(int item_id, double price)
+priceItem(ItemId item_id, double price)
 {
-    // TODO: Your code here.
+    lockItem(item_id);
+    InventoryEntry* entry = inventory.find(item_id);
+    if (entry != NULL && entry->stock->valid) {
+        Item& item = entry->item;
+        bool decreased = price < item.price;
+        bool increased = price > item.price;
+        lockItemVersion(entry);
+        item.price = price;
+        entry->stock->unitPrice = item.price * (1 - item.discount);
+        entry->stock->costSeq   = 1;
+        refreshCost(*entry->stock, readPricing());
+        unlockItemVersion(entry, true);
+        if (decreased)
+            wakeWaiters(entry->waiters, entry->stock->unitCost, true);
+        else if (increased)
+            markPriceBound(entry->waiters);
+    }
+    unlockItem(item_id);
 }
 
 /*
@@ -203,7 +1542,52 @@ priceItem(int item_id, double price)
  *      Change the discount on the item. If the store does not carry
  *      the item, do nothing.
  *
- *      If the item discount increased, wake any waiters.
+ *      If the item discount increased, wake the waiters that can
+ *      now afford it.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+discountItem(ItemId item_id, double discount)
+{
+    lockItem(item_id);
+    InventoryEntry* entry = inventory.find(item_id);
+    if (entry != NULL && entry->stock->valid) {
+        Item& item = entry->item;
+        bool increased = discount > item.discount;
+        bool decreased = discount < item.discount;
+        lockItemVersion(entry);
+        item.discount = discount;
+        entry->stock->unitPrice = item.price * (1 - item.discount);
+        entry->stock->costSeq   = 1;
+        refreshCost(*entry->stock, readPricing());
+        unlockItemVersion(entry, true);
+        if (increased)
+            wakeWaiters(entry->waiters, entry->stock->unitCost, true);
+        else if (decreased)
+            markPriceBound(entry->waiters);
+    }
+    unlockItem(item_id);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * updateItem --
+ *
+ *      Apply several updates of one item at once: increase its
+ *      stock by count, and change its price and its discount if
+ *      setPrice and setDiscount are set. If the store does not
+ *      carry the item, do nothing. The item ends up as if addStock,
+ *      priceItem and discountItem had been called in turn, but its
+ *      lock is taken once and its waiters are looked at once.
+ *
+ *      If the stock grew, wake the waiters that can afford the item
+ *      at its new cost; otherwise, if its price fell, wake the
+ *      price-bound ones among them. If its price rose, every waiter
+ *      becomes price bound first.
  *
  * Results:
  *      None.
@@ -211,9 +1595,35 @@ priceItem(int item_id, double price)
  * ------------------------------------------------------------------
  */
 void EStore::
-discountItem(int item_id, double discount)
+updateItem(ItemId item_id, int count, bool setPrice, double price,
+           bool setDiscount, double discount)
 {
-    // TODO: Your code here.
+    lockItem(item_id);
+    InventoryEntry* entry = inventory.find(item_id);
+    if (entry != NULL && entry->stock->valid) {
+        Item& item = entry->item;
+        ItemStock& stock = *entry->stock;
+        double oldPrice = stock.unitPrice;
+        lockItemVersion(entry);
+        stock.quantity += count;
+        if (setPrice)
+            item.price = price;
+        if (setDiscount)
+            item.discount = discount;
+        if (setPrice || setDiscount) {
+            stock.unitPrice = item.price * (1 - item.discount);
+            stock.costSeq   = 1;
+        }
+        refreshCost(stock, readPricing());
+        unlockItemVersion(entry, true);
+        if (stock.unitPrice > oldPrice)
+            markPriceBound(entry->waiters);
+        if (count > 0)
+            wakeWaiters(entry->waiters, stock.unitCost);
+        else if (stock.unitPrice < oldPrice)
+            wakeWaiters(entry->waiters, stock.unitCost, true);
+    }
+    unlockItem(item_id);
 }
 
 /*
@@ -221,7 +1631,8 @@ discountItem(int item_id, double discount)
  * setShippingCost --
  *
  *      Set the per-item shipping cost. If the shipping cost
- *      decreased, wake any waiters.
+ *      decreased, wake the price-bound waiters; if it increased,
+ *      make every waiter price bound.
  *
  * Results:
  *      None.
@@ -231,15 +1642,25 @@ discountItem(int item_id, double discount)
 void EStore::
 setShippingCost(double cost)
 {
-    // TODO: Your code here.
+    lockStore();
+    double old = pricing.shippingCost.load(memory_order_relaxed);
+    beginPricingUpdate();
+    pricing.shippingCost.store(cost, memory_order_relaxed);
+    endPricingUpdate();
+    if (cost < old)
+        wakeWaiters(storeWaiters, -HUGE_VAL, true);
+    else if (cost > old)
+        markPriceBound(storeWaiters);
+    unlockStore();
 }
 
 /*
  * ------------------------------------------------------------------
  * setStoreDiscount --
  *
- *      Set the store discount. If the discount increased, wake any
- *      waiters.
+ *      Set the store discount. If the discount increased, wake the
+ *      price-bound waiters; if it decreased, make every waiter
+ *      price bound.
  *
  * Results:
  *      None.
@@ -249,7 +1670,61 @@ setShippingCost(double cost)
 void EStore::
 setStoreDiscount(double discount)
 {
-    // TODO: Your code here.
+    lockStore();
+    double old = pricing.storeDiscount.load(memory_order_relaxed);
+    beginPricingUpdate();
+    pricing.storeDiscount.store(discount, memory_order_relaxed);
+    endPricingUpdate();
+    if (discount > old)
+        wakeWaiters(storeWaiters, -HUGE_VAL, true);
+    else if (discount < old)
+        markPriceBound(storeWaiters);
+    unlockStore();
 }
 
+/*
+ * ------------------------------------------------------------------
+ * enableCoroutines --
+ *
+ *      Let purchases run as coroutines, with buyItemAsync and
+ *      buyManyItemsAsync, and resume those woken from waiting on
+ *      sink. Wakers enqueue on sink holding store locks, so an
+ *      enqueue must never block, and sink must accept tasks until
+ *      every purchase has finished. Called before any purchase.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+enableCoroutines(TaskSink* sink)
+{
+    resumeSink = sink;
+}
 
+/*
+ * ------------------------------------------------------------------
+ * close --
+ *
+ *      Stop waiting for purchases. Customers blocked in buyItem or
+ *      buyManyItems give up, and later purchases that cannot be
+ *      bought immediately give up instead of blocking. Called when
+ *      no supplier will change the store any more, so that waiting
+ *      customers would otherwise block forever.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+close()
+{
+    lockStore();
+    beginPricingUpdate();
+    pricing.closed.store(true, memory_order_relaxed);
+    endPricingUpdate();
+    wakeWaiters(storeWaiters);
+    unlockStore();
+}
@@ -1,39 +1,183 @@
 #pragma once
 
+#include <atomic>
+#include <cmath>
 #include <vector>
 
+#include "Coroutine.h"
+#include "Inventory.h"
 #include "Request.h"
+#include "sthread.h"
+#include "TaskQueue.h"
 
 /* 
  * ------------------------------------------------------------------
- * Item -- 
+ * Waiter -- 
  *
- *      This class represents a type of item in the inventory of the
- *      estore.  It keeps track of the number of units in stock, the
- *      price of each unit, etc.
+ *      A customer blocked until its purchase may succeed. The
+ *      waiter is linked onto the wait list of every item in its
+ *      order and onto the store-wide wait list; whoever changes
+ *      one of those sets woken and signals cond.
  *
- *      The current price of an individual item is defined as the
- *      normal price of the item (i.e. the price field of Item) times
- *      1 - the current discount (i.e. the discount field of Item).
- *      When a customer tries to buy an item, the current price of
- *      the item should be used to determine the cost of the overall
- *      purchase.
+ *      priceBound is set while the purchase may be held back by
+ *      its cost rather than only by missing stock. A cheaper price
+ *      only wakes waiters that are price bound; a more expensive
+ *      one makes every waiter it affects price bound.
  *
- *      If the particular item is not being offered by the store,
- *      then the valid field of the item in the inventory will be
- *      set to false.
+ *      In coarse mode cond is used with the store mutex. In fine
+ *      mode the waiter brings its own mutex, which is always the
+ *      last lock taken and protects woken and priceBound while the
+ *      waiter is linked on any list.
+ *
+ *      The waiter of a purchase running as a coroutine has a
+ *      resumeSink and is never signalled. Instead the purchase
+ *      suspends, saving its coroutine in suspended, and whoever
+ *      wakes it enqueues a resume_coroutine_handler task for it on
+ *      resumeSink. woken and suspended are then protected by the
+ *      waiter's mutex in both modes, since the purchase suspends
+ *      after it has let go of the store locks.
  *
  * ------------------------------------------------------------------
  */
-class Item {
-    public:
-    bool valid;
-    int quantity;
-    double price;
-    double discount;
+struct Waiter {
+    smutex_t mutex;
+    scond_t cond;
+    bool woken;
+    bool priceBound;
+    TaskSink* resumeSink;
+    void* suspended;
+
+    explicit Waiter(TaskSink* sink = NULL);
+    ~Waiter();
+
+    void wake(smutex_t* condMutex);
+};
+
+
+/* 
+ * ------------------------------------------------------------------
+ * LockStripe -- 
+ *
+ *      One of the locks protecting the inventory in fine mode. Item
+ *      ids are hashed onto a fixed set of stripes, so that a catalog
+ *      of millions of items needs only a bounded number of locks;
+ *      items that share a stripe are serialized. Each stripe sits on
+ *      its own cache line so that threads working on different
+ *      stripes do not bounce the same line between cores.
+ *
+ *      A stripe is a reader-writer lock: whoever changes an item
+ *      holds it for writing, while customers that only re-check
+ *      their order share it. Waiting writers go first, so that
+ *      suppliers are not starved by re-checking customers.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) LockStripe {
+    srwlock_t lock;
+};
+
+/*
+ * Bounds on the number of lock stripes. A store gets one stripe
+ * per item it is sized for, within these bounds.
+ */
+#define MIN_LOCK_STRIPES 64
+#define MAX_LOCK_STRIPES 65536
 
-    Item();
-    ~Item();
+
+/*
+ * Concurrency control of an EStore. See EStore.
+ */
+enum EStoreMode {
+    COARSE_MODE = 0,
+    FINE_MODE,
+    OPTIMISTIC_MODE
+};
+
+/*
+ * Number of times an optimistic purchase is attempted before it
+ * falls back to taking the item locks.
+ */
+#define MAX_OPTIMISTIC_ATTEMPTS 8
+
+
+/* 
+ * ------------------------------------------------------------------
+ * StorePricing -- 
+ *
+ *      The store-wide fields that every purchase reads, published
+ *      through a sequence lock so that buyers read them without
+ *      writing to a shared cache line.
+ *
+ *      Writers hold the store lock and make seq odd while they
+ *      update the fields. Readers copy the fields and retry if seq
+ *      was odd or changed under them. The fields are atomics only
+ *      so that the racing reads are well defined; the fences around
+ *      seq provide the ordering.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) StorePricing {
+    std::atomic<unsigned long> seq;
+    std::atomic<double> shippingCost;
+    std::atomic<double> storeDiscount;
+    std::atomic<bool> closed;
+};
+
+/*
+ * A consistent copy of StorePricing. version is the seq it was
+ * read at and changes whenever any of the fields does.
+ */
+struct PricingSnapshot {
+    unsigned long version;
+    double shippingCost;
+    double storeDiscount;
+    bool closed;
+};
+
+
+/* 
+ * ------------------------------------------------------------------
+ * EStoreStats -- 
+ *
+ *      Counters describing how waiting customers were woken.
+ *
+ *      stateChanges counts the updates that could let a waiting
+ *      customer buy, wakeups counts the waiters signalled by them
+ *      and futileWakeups counts the waiters that, once woken, still
+ *      could not buy and went back to sleep. waitingOrders is not a
+ *      counter but the number of orders waiting right now.
+ *      suspendedPurchases counts the times a purchase running as a
+ *      coroutine suspended to wait instead of blocking its thread.
+ *
+ *      contendedLocks counts the acquires of a store lock that
+ *      found it held by another thread and lockWaitNs the total
+ *      time, in nanoseconds, spent waiting for them.
+ *
+ *      In optimistic mode, optimisticCommits counts the purchases
+ *      decided without locks, optimisticAborts the attempts thrown
+ *      away because of a conflicting update and optimisticFallbacks
+ *      the purchases that gave up on MAX_OPTIMISTIC_ATTEMPTS
+ *      attempts and took the item locks instead.
+ *
+ * ------------------------------------------------------------------
+ */
+struct EStoreStats {
+    std::atomic<long> stateChanges;
+    std::atomic<long> wakeups;
+    std::atomic<long> futileWakeups;
+    std::atomic<long> waitingOrders;
+    std::atomic<long> suspendedPurchases;
+    std::atomic<long> contendedLocks;
+    std::atomic<long> lockWaitNs;
+    std::atomic<long> optimisticCommits;
+    std::atomic<long> optimisticAborts;
+    std::atomic<long> optimisticFallbacks;
+
+    EStoreStats()
+        : stateChanges(0), wakeups(0), futileWakeups(0), waitingOrders(0),
+          suspendedPurchases(0), contendedLocks(0), lockWaitNs(0),
+          optimisticCommits(0), optimisticAborts(0),
+          optimisticFallbacks(0) { }
 };
 
 
@@ -45,15 +189,19 @@ class Item {
  *      Customers and suppliers interact with the store through the
  *      methods of this class.
  *
- *      Items in the inventory are indexed by their item IDs.
+ *      Items in the inventory are indexed by their 64-bit item IDs,
+ *      which may be sparse. The inventory is a concurrent hash map
+ *      (see Inventory) sized for the capacity given at construction;
+ *      an id the store has never carried has no entry at all.
  *
  *      The store discount should initially be set to 0.
  *      The shipping cost should initially be set to 3.
  *
- *      If fineMode is false, then this class functions strictly as
- *      a monitor. The buyItem method only functions in this mode.
+ *      In COARSE_MODE this class functions strictly as a monitor.
+ *      The buyItem method only functions in this mode.
  *
- *      If fineMode is true, simultaneous requests for:
+ *      In FINE_MODE and OPTIMISTIC_MODE (together, fineMode),
+ *      simultaneous requests for:
  *          - addItem,
  *          - removeItem,
  *          - addStock,
@@ -62,17 +210,176 @@ class Item {
  *      that reference different item ids must process at the same
  *      time. The buyManyItems method only functions in this mode.
  *
+ *      If waitForOrders is true, buyManyItems waits until the order
+ *      can be bought, like buyItem does, instead of giving up.
+ *
+ *      Locking: in coarse mode every method runs under the single
+ *      store mutex. In fine mode each inventory entry is protected
+ *      by the LockStripe its id hashes to, which also serializes
+ *      inserting the entry, and the shipping cost, the store
+ *      discount and the store-wide wait list are protected by
+ *      storeLock. Both are reader-writer locks, held for writing
+ *      by whoever changes what they protect. A thread that needs
+ *      several locks acquires the stripes in increasing stripe
+ *      order, then storeLock, then a Waiter's mutex.
+ *
+ *      In both modes the shipping cost, store discount and closed
+ *      flag are only written under the store lock, but purchases
+ *      read them through the pricing seqlock without taking it.
+ *      Purchases price items from the unit cost cached in their
+ *      ItemStock. Item writers recompute it eagerly; a change to
+ *      the store-wide fields invalidates every cached cost at once,
+ *      and buyers holding the item's lock recompute it on first use.
+ *
+ *      Optimistic mode locks like fine mode, except that
+ *      buyManyItems first tries to buy without any lock: it reads
+ *      the version and contents of every item in the order,
+ *      decides, and commits by moving every version it read to odd
+ *      with a compare-and-swap. If any version moved in between,
+ *      the attempt is aborted and retried. An entry's version is
+ *      even while the item is stable; whoever changes the item
+ *      makes it odd first, which excludes every other writer, and
+ *      even again, and different, once done. Writers of an item
+ *      take its version after its stripe, so the stripes still
+ *      serialize suppliers and the orders that wait.
+ *
+ *      A waiting order that is woken re-checks itself holding its
+ *      stripes and storeLock for reading only, so that the customers
+ *      woken by one change re-check in parallel. If it still cannot
+ *      be bought it goes back to sleep without leaving its wait
+ *      lists: they cannot change under the read locks.
+ *
+ *      Waking: a change to an item wakes only the customers waiting
+ *      on that item, and of those only the ones it could let buy:
+ *      each waiter is listed on an item with the highest unit cost
+ *      of the item at which its purchase could be afforded, and a
+ *      price drop or restock skips the waiters whose bound is below
+ *      the item's cost. A price drop, of an item or store-wide, also
+ *      skips the waiters that could already afford their order and
+ *      only lack stock. Removing an item or closing the store wakes
+ *      all its waiters.
+ *
+ *      Once enableCoroutines has been called, buyItemAsync and
+ *      buyManyItemsAsync run purchases as coroutines, which decide
+ *      the purchase like buyItem and buyManyItems but, instead of
+ *      blocking their thread while the order waits, let go of the
+ *      store locks and suspend until a waker enqueues them on the
+ *      resume sink. A few threads can then carry any number of
+ *      waiting orders.
+ *
  * ------------------------------------------------------------------
  */
 class EStore {
     private:
-    Item inventory[INVENTORY_SIZE];
+    /*
+     * One distinct item of an order, as buyManyItems works on it:
+     * how many units are wanted, the stripe the id hashes to and,
+     * once looked up, its entry (NULL if the store never carried
+     * it).
+     */
+    struct OrderLine {
+        ItemId id;
+        int wanted;
+        size_t stripe;
+        InventoryEntry* entry;
+    };
+
+    /*
+     * An unlocked copy of the ItemStock fields an optimistic
+     * purchase decides on.
+     */
+    struct StockCopy {
+        bool valid;
+        int quantity;
+        double unitPrice;
+        double unitCost;
+        unsigned long costSeq;
+    };
+
+    /*
+     * Where a purchase stands after an attempt to buy it: bought,
+     * given up, or listed on its wait lists until a change may let
+     * it buy.
+     */
+    enum PurchaseStep {
+        PURCHASE_BOUGHT,
+        PURCHASE_GIVEN_UP,
+        PURCHASE_WAITING
+    };
+
+    Inventory inventory;
+    const EStoreMode mode;
     const bool fineMode;
-    // TODO: More needed here.
+    const bool optimistic;
+    const bool waitForOrders;
+
+    StorePricing pricing;
+
+    // Coarse mode: the monitor lock.
+    smutex_t mutex;
+
+    // Fine mode: the lock stripes of the inventory plus one lock for
+    // the store-wide fields. The wait lists are used in both modes.
+    LockStripe* stripes;
+    size_t stripeMask;
+    srwlock_t storeLock;
+    WaitList storeWaiters;
+
+    // Where woken coroutine purchases are resumed, or NULL.
+    TaskSink* resumeSink;
+
+    EStoreStats stats;
+
+    size_t stripeOf(ItemId item_id) const;
+    void lockItem(ItemId item_id);
+    void unlockItem(ItemId item_id);
+    void lockStore();
+    void unlockStore();
+    void acquire(smutex_t* lock);
+    void acquire(srwlock_t* lock, bool shared = false);
+    PricingSnapshot readPricing() const;
+    bool pricingCurrent(const PricingSnapshot& snapshot) const;
+    void beginPricingUpdate();
+    void endPricingUpdate();
+    double itemCost(double unitPrice, double discount, double shipping) const;
+    double cachedCost(const StockCopy& copy,
+                      const PricingSnapshot& snapshot) const;
+    bool refreshCost(ItemStock& stock, const PricingSnapshot& snapshot);
+
+    void lockItemVersion(InventoryEntry* entry);
+    void unlockItemVersion(InventoryEntry* entry, bool changed);
+    bool readItems(const OrderLine* lines, int numLines, StockCopy* copies,
+                   unsigned long* versions);
+    void lockOrder(const OrderLine* lines, int numLines, bool shared = false);
+    void unlockOrder(const OrderLine* lines, int numLines,
+                     bool shared = false);
+    int prepareOrder(const ItemId* item_ids, int numItems, OrderLine* lines);
+    bool findOrder(OrderLine* lines, int numLines);
+    bool buyManyItemsOptimistic(OrderLine* lines, int numLines,
+                                double budget, bool* bought);
+    bool buyManyItemsLocked(OrderLine* lines, int numLines, double budget);
+    PurchaseStep tryBuyItem(InventoryEntry* entry, double budget,
+                            Waiter* waiter, bool wasWoken);
+    void unlistItemWaiter(InventoryEntry* entry, Waiter* waiter);
+    PurchaseStep tryBuyOrder(OrderLine* lines, int numLines, double budget,
+                             Waiter* waiter, bool wasWoken,
+                             double* shippingCost);
+    void unlistOrderWaiter(const OrderLine* lines, int numLines,
+                           Waiter* waiter);
+    bool rearmWaiter(const OrderLine* lines, int numLines, double budget,
+                     Waiter* waiter, double shippingCost);
+
+    void addWaiter(WaitList& list, Waiter* waiter, double maxCost = HUGE_VAL);
+    void removeWaiter(WaitList& list, Waiter* waiter);
+    void wakeWaiters(WaitList& list, double cost = -HUGE_VAL,
+                     bool priceDrop = false);
+    void markPriceBound(WaitList& list);
 
     public:
 
-    explicit EStore(bool enableFineMode);
+    explicit EStore(EStoreMode storeMode, bool enableWaitForOrders = false,
+                    size_t capacity = INVENTORY_SIZE,
+                    InventoryLayout layout = PADDED_LAYOUT);
     ~EStore();
 
     // no default copy constructor and assignment operators. this will prevent some
@@ -80,17 +387,31 @@ class EStore {
     EStore(const EStore&) = delete;
     EStore& operator=(const EStore &) = delete;
 
-    void buyItem(int item_id, double budget);
-    void addItem(int item_id, int quantity, double price, double discount);
-    void removeItem(int item_id);
-    void addStock(int item_id, int count);
-    void priceItem(int item_id, double price);
-    void discountItem(int item_id, double discount);
+    bool buyItem(ItemId item_id, double budget);
+    void addItem(ItemId item_id, int quantity, double price, double discount);
+    void removeItem(ItemId item_id);
+    void addStock(ItemId item_id, int count);
+    void priceItem(ItemId item_id, double price);
+    void discountItem(ItemId item_id, double discount);
+    void updateItem(ItemId item_id, int count, bool setPrice, double price,
+                    bool setDiscount, double discount);
     void setShippingCost(double price);
     void setStoreDiscount(double discount);
 
-    void buyManyItems(std::vector<int>* item_ids, double budget);
+    bool buyManyItems(const ItemId* item_ids, int numItems, double budget);
+
+    void enableCoroutines(TaskSink* sink);
+    Purchase buyItemAsync(ItemId item_id, double budget);
+    Purchase buyManyItemsAsync(const ItemId* item_ids, int numItems,
+                               double budget);
+
+    void close();
 
     bool fineModeEnabled() const { return fineMode; }
+    bool coroutinesEnabled() const { return resumeSink != NULL; }
+    EStoreMode getMode() const { return mode; }
+    const EStoreStats& getStats() const { return stats; }
+    size_t inventorySize() const { return inventory.size(); }
+    size_t inventoryMemory();
 };
 
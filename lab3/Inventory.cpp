@@ -0,0 +1,157 @@
+#include <cstdlib>
+#include <new>
+
+#include "Inventory.h"
+
+using namespace std;
+
+
+Item::
+Item() : price(0), discount(0)
+{ }
+
+Item::
+~Item()
+{ }
+
+
+Inventory::
+Inventory(size_t expectedItems, InventoryLayout layout)
+    : stockStride(layout == PADDED_LAYOUT ? CACHE_LINE_SIZE
+                                          : sizeof(ItemStock)),
+      chunkUsed(INVENTORY_CHUNK), count(0)
+{
+    size_t numBuckets = 1;
+    while (numBuckets < expectedItems)
+        numBuckets <<= 1;
+
+    buckets = new atomic<InventoryEntry*>[numBuckets];
+    for (size_t i = 0; i < numBuckets; i++)
+        buckets[i].store(NULL, memory_order_relaxed);
+    bucketMask = numBuckets - 1;
+
+    smutex_init(&chunkLock);
+    sthread_profile_name(&chunkLock, "Inventory::chunkLock");
+}
+
+Inventory::
+~Inventory()
+{
+    for (InventoryEntry* chunk : chunks)
+        delete[] chunk;
+    for (unsigned char* stocks : stockChunks)
+        free(stocks);
+    smutex_destroy(&chunkLock);
+    delete[] buckets;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * allocateEntry --
+ *
+ *      Take an unused entry from the current chunk, and its
+ *      ItemStock from the chunk's stock array, starting a new chunk
+ *      when it is full.
+ *
+ * Results:
+ *      A default-constructed entry.
+ *
+ * ------------------------------------------------------------------
+ */
+InventoryEntry* Inventory::
+allocateEntry()
+{
+    smutex_lock(&chunkLock);
+    if (chunkUsed == INVENTORY_CHUNK) {
+        chunks.push_back(new InventoryEntry[INVENTORY_CHUNK]);
+        void* stocks = aligned_alloc(CACHE_LINE_SIZE,
+                                     stockStride * INVENTORY_CHUNK);
+        if (stocks == NULL)
+            throw bad_alloc();
+        stockChunks.push_back(static_cast<unsigned char*>(stocks));
+        chunkUsed = 0;
+    }
+    InventoryEntry* entry = &chunks.back()[chunkUsed];
+    entry->stock =
+        new (stockChunks.back() + chunkUsed * stockStride) ItemStock();
+    chunkUsed++;
+    smutex_unlock(&chunkLock);
+    return entry;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * find --
+ *
+ *      Look up the entry of id without locking.
+ *
+ * Results:
+ *      The entry, or NULL if id was never inserted.
+ *
+ * ------------------------------------------------------------------
+ */
+InventoryEntry* Inventory::
+find(ItemId id) const
+{
+    InventoryEntry* entry =
+        buckets[fold_item_id(id) & bucketMask].load(memory_order_acquire);
+    while (entry != NULL && entry->id != id)
+        entry = entry->next.load(memory_order_acquire);
+    return entry;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * insert --
+ *
+ *      Add an entry for id, which must not be present, and link it
+ *      at the head of its bucket. The entry's item is not valid
+ *      until the caller fills it in.
+ *
+ * Results:
+ *      The new entry.
+ *
+ * ------------------------------------------------------------------
+ */
+InventoryEntry* Inventory::
+insert(ItemId id)
+{
+    InventoryEntry* entry = allocateEntry();
+    entry->id = id;
+
+    atomic<InventoryEntry*>& head = buckets[fold_item_id(id) & bucketMask];
+    InventoryEntry* first = head.load(memory_order_relaxed);
+    do {
+        entry->next.store(first, memory_order_relaxed);
+    } while (!head.compare_exchange_weak(first, entry, memory_order_release,
+                                         memory_order_relaxed));
+
+    count.fetch_add(1, memory_order_relaxed);
+    return entry;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * memoryUsed --
+ *
+ *      Return the memory held by the table: the bucket array and
+ *      every entry chunk and its stock array, including entries
+ *      not yet handed out.
+ *      Memory the waiter lists allocate is not counted.
+ *
+ * Results:
+ *      The size in bytes.
+ *
+ * ------------------------------------------------------------------
+ */
+size_t Inventory::
+memoryUsed()
+{
+    smutex_lock(&chunkLock);
+    size_t numChunks = chunks.size();
+    smutex_unlock(&chunkLock);
+
+    return (bucketMask + 1) * sizeof(buckets[0]) +
+           numChunks * INVENTORY_CHUNK *
+               (sizeof(InventoryEntry) + stockStride);
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include "Request.h"
+#include "sthread.h"
+
+/*
+ * ------------------------------------------------------------------
+ * Item --
+ *
+ *      This class represents a type of item in the inventory of the
+ *      estore: the normal price of each unit and the current
+ *      discount on it. These fields are only read on the buy path,
+ *      and only change when a supplier reprices the item.
+ *
+ *      The current price of an individual item is defined as the
+ *      normal price of the item (i.e. the price field of Item) times
+ *      1 - the current discount (i.e. the discount field of Item).
+ *      When a customer tries to buy an item, the current price of
+ *      the item should be used to determine the cost of the overall
+ *      purchase. It is kept precomputed in the item's ItemStock.
+ *
+ * ------------------------------------------------------------------
+ */
+class Item {
+    public:
+    double price;
+    double discount;
+
+    Item();
+    ~Item();
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ItemStock --
+ *
+ *      The fields of an item that every purchase reads and writes:
+ *      whether the store carries it, the number of units in stock,
+ *      its current unit price (see Item) and, in optimistic mode,
+ *      its version (see EStore). If the store does not offer the
+ *      item, valid is false.
+ *
+ *      unitCost caches what one unit costs a buyer, the unit price
+ *      after the store discount plus shipping, as of the store
+ *      pricing version costSeq. A change to the store discount or
+ *      shipping cost moves the pricing version on, so it makes
+ *      every cached cost stale at once; each is recomputed the next
+ *      time the item is priced under a lock. costSeq is odd while
+ *      no cost is cached, since pricing versions are even.
+ *
+ *      ItemStocks are kept apart from the rest of the entry, in an
+ *      array per chunk of entries, so that buyers touch as few
+ *      cache lines as possible. With PADDED_LAYOUT every ItemStock
+ *      has a cache line of its own and buyers of different items
+ *      never write to the same line.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ItemStock {
+    std::atomic<unsigned long> version;
+    double unitPrice;
+    double unitCost;
+    unsigned long costSeq;
+    int quantity;
+    bool valid;
+
+    ItemStock()
+        : version(0), unitPrice(0), unitCost(0), costSeq(1), quantity(0),
+          valid(false) { }
+};
+
+/*
+ * How the ItemStocks of a chunk are laid out. PACKED_LAYOUT puts
+ * them next to each other, sizeof(ItemStock) bytes apart, so that
+ * neighbouring items share cache lines. PADDED_LAYOUT puts each on
+ * its own cache line, at the cost of memory.
+ */
+enum InventoryLayout {
+    PACKED_LAYOUT = 0,
+    PADDED_LAYOUT
+};
+
+struct Waiter;
+
+/*
+ * A customer on a wait list and the highest unit cost of the listed
+ * item at which its purchase could go through. An item's waiters
+ * are kept sorted by decreasing maxCost, so that a change that
+ * brings the item down to some cost only has to look at the waiters
+ * at the front of the list.
+ */
+struct WaitSlot {
+    double maxCost;
+    Waiter* waiter;
+};
+
+typedef std::vector<WaitSlot> WaitList;
+
+/*
+ * ------------------------------------------------------------------
+ * InventoryEntry --
+ *
+ *      One item the store has ever carried: its hot ItemStock, its
+ *      read-mostly Item and the customers waiting on it. Entries
+ *      are linked into their hash bucket by next and are never
+ *      unlinked; removing an item from sale only clears
+ *      stock->valid.
+ *
+ * ------------------------------------------------------------------
+ */
+struct InventoryEntry {
+    ItemId id;
+    std::atomic<InventoryEntry*> next;
+    ItemStock* stock;
+    Item item;
+    WaitList waiters;
+
+    InventoryEntry() : id(0), next(NULL), stock(NULL) { }
+};
+
+/*
+ * Entries are allocated this many at a time.
+ */
+#define INVENTORY_CHUNK 4096
+
+/*
+ * ------------------------------------------------------------------
+ * Inventory --
+ *
+ *      A concurrent hash map from item ids to InventoryEntries.
+ *
+ *      The number of buckets is fixed at construction to the
+ *      expected number of items rounded up to a power of two, so
+ *      the table never has to be resized under its readers; more
+ *      items than expected only make the chains longer.
+ *
+ *      find is lock-free: bucket heads and next pointers are
+ *      published with release stores, and entries are never
+ *      unlinked or freed while the Inventory exists. insert pushes
+ *      a new entry on its bucket with a compare-and-swap. The
+ *      caller must make sure that no two threads insert the same
+ *      id at once; EStore does so by holding the id's item lock
+ *      (its lock stripe, in fine mode).
+ *
+ *      Entries come from chunks of INVENTORY_CHUNK entries, so that
+ *      a large catalog costs one allocation per chunk rather than
+ *      one per item. Each chunk has a parallel array of ItemStocks
+ *      laid out as the layout given at construction says.
+ *
+ * ------------------------------------------------------------------
+ */
+class Inventory {
+    private:
+    std::atomic<InventoryEntry*>* buckets;
+    size_t bucketMask;
+
+    const size_t stockStride;
+
+    smutex_t chunkLock;
+    std::vector<InventoryEntry*> chunks;
+    std::vector<unsigned char*> stockChunks;
+    size_t chunkUsed;
+    std::atomic<size_t> count;
+
+    InventoryEntry* allocateEntry();
+
+    public:
+    Inventory(size_t expectedItems, InventoryLayout layout);
+    ~Inventory();
+
+    // no default copy constructor and assignment operators. this will prevent some
+    // painful bugs by converting them into compiler errors.
+    Inventory(const Inventory&) = delete;
+    Inventory& operator=(const Inventory &) = delete;
+
+    InventoryEntry* find(ItemId id) const;
+    InventoryEntry* insert(ItemId id);
+
+    size_t size() const { return count.load(); }
+    size_t memoryUsed();
+};
+
+/*
+ * Fold the bits of a 64-bit id into the low bits used to index
+ * buckets and lock stripes. Small dense ids map to themselves, so
+ * they never collide; sparse ids are spread by their high bits.
+ */
+static inline size_t
+fold_item_id(ItemId id)
+{
+    return id ^ (id >> 21) ^ (id >> 42);
+}
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <cassert>
+
+#include "LatencyRecorder.h"
+
+using namespace std;
+
+LatencyRecorder::
+LatencyRecorder()
+    : total(0), sumNs(0), maxNs(0)
+{
+    fill(counts, counts + LATENCY_BUCKETS, 0);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * bucketOf --
+ *
+ *      Map a latency to its bucket. Latencies below
+ *      LATENCY_SUB_BUCKETS get a bucket each; above that, the
+ *      power of two of the latency picks a row of
+ *      LATENCY_SUB_BUCKETS buckets and the next LATENCY_SUB_BITS
+ *      bits pick the bucket within the row.
+ *
+ * Results:
+ *      The bucket index.
+ *
+ * ------------------------------------------------------------------
+ */
+int LatencyRecorder::
+bucketOf(long ns)
+{
+    if (ns < LATENCY_SUB_BUCKETS)
+        return ns < 0 ? 0 : ns;
+
+    int msb = 63 - __builtin_clzl(ns);
+    int shift = msb - LATENCY_SUB_BITS;
+    int sub = (ns >> shift) & (LATENCY_SUB_BUCKETS - 1);
+    return (shift + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * bucketLimit --
+ *
+ *      Return the largest latency that falls into bucket.
+ *
+ * Results:
+ *      The upper bound of the bucket, in nanoseconds.
+ *
+ * ------------------------------------------------------------------
+ */
+long LatencyRecorder::
+bucketLimit(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    long sub = bucket % LATENCY_SUB_BUCKETS;
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * record --
+ *
+ *      Add one latency sample.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void LatencyRecorder::
+record(long ns)
+{
+    counts[bucketOf(ns)]++;
+    total++;
+    sumNs += ns;
+    maxNs = max(maxNs, ns);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * merge --
+ *
+ *      Add the samples of other to this recorder.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void LatencyRecorder::
+merge(const LatencyRecorder& other)
+{
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        counts[i] += other.counts[i];
+    total += other.total;
+    sumNs += other.sumNs;
+    maxNs = max(maxNs, other.maxNs);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * percentileNs --
+ *
+ *      Return the latency below which a fraction p of the samples
+ *      fall, for 0 < p <= 1, rounded up to the end of its bucket
+ *      but never above the largest sample.
+ *
+ * Results:
+ *      The latency in nanoseconds, or 0 if nothing was recorded.
+ *
+ * ------------------------------------------------------------------
+ */
+long LatencyRecorder::
+percentileNs(double p) const
+{
+    assert(p > 0 && p <= 1);
+    if (total == 0)
+        return 0;
+
+    long rank = (long) (p * total + 0.5);
+    rank = max(rank, 1L);
+
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            return min(bucketLimit(i), maxNs);
+    }
+    return maxNs;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+/*
+ * Each power of two of latency is split into LATENCY_SUB_BUCKETS
+ * buckets, which bounds the error of a percentile to 1/16 of its
+ * value.
+ */
+#define LATENCY_SUB_BITS    4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS     (64 * LATENCY_SUB_BUCKETS)
+
+/*
+ * ------------------------------------------------------------------
+ * LatencyRecorder --
+ *
+ *      A log-linear histogram of latencies in nanoseconds. A
+ *      recorder is not thread-safe: every thread records into its
+ *      own and the recorders are merged once the threads are done.
+ *
+ * ------------------------------------------------------------------
+ */
+class LatencyRecorder {
+    private:
+    long counts[LATENCY_BUCKETS];
+    long total;
+    long sumNs;
+    long maxNs;
+
+    static int bucketOf(long ns);
+    static long bucketLimit(int bucket);
+
+    public:
+    LatencyRecorder();
+
+    void record(long ns);
+    void merge(const LatencyRecorder& other);
+
+    long count() const { return total; }
+    double meanNs() const { return total ? (double) sumNs / total : 0.0; }
+    long percentileNs(double p) const;
+};
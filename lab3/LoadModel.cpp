@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+
+#include "LoadModel.h"
+#include "sthread.h"
+
+using namespace std;
+
+double
+random_unit()
+{
+    return (sutil_random() + 1.0) / (RAND_MAX + 2.0);
+}
+
+/*
+ * An exponentially distributed value with the given mean.
+ */
+static double
+random_exponential(double mean)
+{
+    return -mean * log(random_unit());
+}
+
+ArrivalProcess::
+ArrivalProcess(ArrivalKind arrivalKind, double ratePerSec)
+    : kind(arrivalKind), meanGapNs(1e9 / ratePerSec), onLeftNs(0)
+{
+    assert(ratePerSec > 0);
+    if (kind == BURSTY_ARRIVALS)
+        onLeftNs = random_exponential(BURST_MEAN_ON_NS);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * nextGapNs --
+ *
+ *      Return the time between the previous arrival and the next.
+ *
+ *      For bursty arrivals, a gap that runs past the end of the
+ *      current on period skips an off period and continues in the
+ *      next on period. Since exponential gaps are memoryless the
+ *      unused part of the gap can simply be dropped.
+ *
+ * Results:
+ *      The gap in nanoseconds.
+ *
+ * ------------------------------------------------------------------
+ */
+long long ArrivalProcess::
+nextGapNs()
+{
+    switch (kind) {
+        case CONSTANT_ARRIVALS:
+            return meanGapNs;
+        case POISSON_ARRIVALS:
+            return random_exponential(meanGapNs);
+        case BURSTY_ARRIVALS:
+        {
+            double dutyCycle =
+                BURST_MEAN_ON_NS / (BURST_MEAN_ON_NS + BURST_MEAN_OFF_NS);
+            double peakGapNs = meanGapNs * dutyCycle;
+            double gap = 0;
+            while (true) {
+                double next = random_exponential(peakGapNs);
+                if (next <= onLeftNs) {
+                    onLeftNs -= next;
+                    return gap + next;
+                }
+                gap += onLeftNs + random_exponential(BURST_MEAN_OFF_NS);
+                onLeftNs = random_exponential(BURST_MEAN_ON_NS);
+            }
+        }
+    }
+    assert(false);
+    return meanGapNs;
+}
+
+ZipfDistribution::
+ZipfDistribution(int n, double skew)
+    : cdf(n)
+{
+    assert(n > 0 && skew >= 0);
+
+    double sum = 0;
+    for (int k = 0; k < n; k++) {
+        sum += 1.0 / pow(k + 1, skew);
+        cdf[k] = sum;
+    }
+    for (int k = 0; k < n; k++)
+        cdf[k] /= sum;
+    cdf[n - 1] = 1.0;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * sample --
+ *
+ *      Draw an item id.
+ *
+ * Results:
+ *      An id in [0, n).
+ *
+ * ------------------------------------------------------------------
+ */
+int ZipfDistribution::
+sample() const
+{
+    return lower_bound(cdf.begin(), cdf.end(), random_unit()) - cdf.begin();
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+
+/*
+ * How requests arrive at the store.
+ *
+ * CONSTANT_ARRIVALS issue one request every 1/rate seconds.
+ * POISSON_ARRIVALS have exponentially distributed gaps of mean
+ * 1/rate. BURSTY_ARRIVALS alternate exponentially distributed on
+ * and off periods; requests arrive as a Poisson process during on
+ * periods and not at all during off periods, with the peak rate
+ * chosen so that the long-run average is still rate.
+ */
+enum ArrivalKind {
+    CONSTANT_ARRIVALS = 0,
+    POISSON_ARRIVALS,
+    BURSTY_ARRIVALS
+};
+
+#define DEFAULT_ARRIVAL_RATE 10.0
+
+#define BURST_MEAN_ON_NS     200000000.0
+#define BURST_MEAN_OFF_NS    800000000.0
+
+/*
+ * ------------------------------------------------------------------
+ * ArrivalProcess --
+ *
+ *      Produces the gaps between consecutive request arrivals for
+ *      one generator. Not thread-safe; every generator owns one.
+ *
+ * ------------------------------------------------------------------
+ */
+class ArrivalProcess {
+    private:
+    ArrivalKind kind;
+    double meanGapNs;
+    double onLeftNs;
+
+    public:
+    ArrivalProcess(ArrivalKind arrivalKind = CONSTANT_ARRIVALS,
+                   double ratePerSec = DEFAULT_ARRIVAL_RATE);
+
+    long long nextGapNs();
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ZipfDistribution --
+ *
+ *      Draws item ids in [0, n) with P(id = k) proportional to
+ *      1 / (k + 1)^skew, so low ids are the hot items. A skew of 0
+ *      is uniform. Sampling is a binary search over the
+ *      precomputed cumulative distribution. Read-only after
+ *      construction, so one instance can be shared.
+ *
+ * ------------------------------------------------------------------
+ */
+class ZipfDistribution {
+    private:
+    std::vector<double> cdf;
+
+    public:
+    ZipfDistribution(int n, double skew);
+
+    int sample() const;
+};
+
+/*
+ * A uniformly distributed double in (0, 1), drawn from sutil_random.
+ */
+double random_unit();
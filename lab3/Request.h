@@ -1,7 +1,9 @@
 #pragma once
 
-#include <vector>
+#include <cstdint>
 
+// The default number of items in the store's catalog, and so the
+// default range of item ids.
 #define INVENTORY_SIZE    100
 
 #define MAX_BUY_ITEM      8
@@ -13,6 +15,11 @@
 
 // Forward declaration. Do not remove!!
 class EStore;
+class Completion;
+
+// Item ids are arbitrary 64-bit values; the store's catalog need
+// not be dense.
+typedef uint64_t ItemId;
 
 enum SupplierRequestTypes {
     ADD_ITEM = 0,
@@ -22,13 +29,25 @@ enum SupplierRequestTypes {
     CHANGE_ITEM_DISCOUNT,
     SET_SHIPPING_COST,
     SET_STORE_DISCOUNT,
+    UPDATE_ITEM,
     NUM_SUPPLIER_REQUEST_TYPES
 };
 
+// Suppliers issue every type of request before UPDATE_ITEM. Update
+// item requests are only made by merging the updates of one item
+// (see UpdateCoalescer).
+#define NUM_ISSUED_SUPPLIER_REQUEST_TYPES UPDATE_ITEM
+
+enum CustomerRequestTypes {
+    BUY_ITEM = NUM_SUPPLIER_REQUEST_TYPES,
+    BUY_MANY_ITEMS,
+    NUM_REQUEST_TYPES
+};
+
 struct AddItemReq {
     EStore* store;
 
-    int item_id;
+    ItemId item_id;
     int quantity;
     double price;
     double discount;
@@ -37,27 +56,27 @@ struct AddItemReq {
 struct RemoveItemReq {
     EStore* store;
 
-    int item_id;
+    ItemId item_id;
 };
 
 struct AddStockReq {
     EStore* store;
 
-    int item_id;
+    ItemId item_id;
     int additional_stock;
 };
 
 struct ChangeItemPriceReq {
     EStore* store;
 
-    int item_id;
+    ItemId item_id;
     double new_price;
 };
 
 struct ChangeItemDiscountReq {
     EStore* store;
 
-    int item_id;
+    ItemId item_id;
     double new_discount;
 };
 
@@ -73,17 +92,37 @@ struct SetStoreDiscountReq {
     double new_discount;
 };
 
+// Several supplier updates of one item, applied at once: stock to
+// add, and the last new price and discount if there were any.
+struct UpdateItemReq {
+    EStore* store;
+
+    ItemId item_id;
+    int additional_stock;
+    bool set_price;
+    bool set_discount;
+    double new_price;
+    double new_discount;
+};
+
+// Purchases may carry a Completion, which their handler completes
+// with whether the order was bought; NULL if nobody is interested.
 struct BuyItemReq {
     EStore* store;
 
-    int item_id;
+    ItemId item_id;
     double budget;
+    Completion* completion;
 };
 
+// The order is stored inline, so that a request is one fixed-size
+// block that a RequestPool can hand out.
 struct BuyManyItemsReq {
     EStore* store;
 
-    std::vector<int> item_ids;
+    ItemId item_ids[MAX_BUY_ITEM];
+    int num_items;
     double budget;
+    Completion* completion;
 };
 
@@ -1,17 +1,36 @@
+#include <algorithm>
 #include <iostream>
 #include <cstdlib>
 #include <cassert>
-#include <set>
 
 #include "RequestHandlers.h"
 #include "RequestGenerator.h"
+#include "RequestPool.h"
 
 using namespace std;
 
-static int
-rand_id()
+static ItemId
+rand_id(ItemId numItems)
 {
-    return sutil_random() % INVENTORY_SIZE;
+    ItemId r = sutil_random();
+    if (numItems > RAND_MAX)
+        r = (r << 31) | sutil_random();
+    return r % numItems;
+}
+
+/*
+ * Spread item index k over the whole 64-bit id space. The mix is a
+ * bijection, so distinct indices always give distinct ids.
+ */
+static ItemId
+sparse_id(ItemId k)
+{
+    k ^= k >> 30;
+    k *= 0xbf58476d1ce4e5b9ULL;
+    k ^= k >> 27;
+    k *= 0x94d049bb133111ebULL;
+    k ^= k >> 31;
+    return k;
 }
 
 static int
@@ -35,27 +54,230 @@ rand_discount()
 static int
 rand_request()
 {
-    return sutil_random() % NUM_SUPPLIER_REQUEST_TYPES;
+    return sutil_random() % NUM_ISSUED_SUPPLIER_REQUEST_TYPES;
 }
 
 RequestGenerator::
-RequestGenerator(TaskQueue* queue)
-    : taskQueue(queue), taskCount(0)
+RequestGenerator(TaskSink* queue)
+    : taskQueue(queue), popularity(NULL), sparseIds(false),
+      trace(NULL), traceStream(SUPPLIER_STREAM), itemSpace(INVENTORY_SIZE),
+      taskCount(0), batchSize(1)
 { }
 
 RequestGenerator::
 ~RequestGenerator()
 { }
 
+/*
+ * ------------------------------------------------------------------
+ * setBatchSize --
+ *
+ *      Make enqueueTasks generate bursts of up to size tasks and
+ *      hand each burst to the task queue with one enqueueBatch
+ *      call. The generator keeps the same average request rate.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setBatchSize(int size)
+{
+    assert(size >= 1 && size <= MAX_TASK_BATCH);
+    batchSize = size;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setArrivals --
+ *
+ *      Make enqueueTasks issue requests according to the given
+ *      arrival process at an average of ratePerSec requests per
+ *      second. The default is CONSTANT_ARRIVALS at
+ *      DEFAULT_ARRIVAL_RATE.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setArrivals(ArrivalKind kind, double ratePerSec)
+{
+    arrivals = ArrivalProcess(kind, ratePerSec);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setItemPopularity --
+ *
+ *      Draw the item ids of requests from zipf instead of uniformly.
+ *      zipf must cover the item space (see setItemSpace) and
+ *      outlive the generator; NULL restores uniform ids.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setItemPopularity(const ZipfDistribution* zipf)
+{
+    popularity = zipf;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setItemSpace --
+ *
+ *      Draw requests from a catalog of numItems items. The ids are
+ *      0 to numItems - 1 unless sparse is set, in which case each
+ *      of those indices is mapped to an id scattered over the
+ *      whole 64-bit range. Generators that share a store must be
+ *      given the same item space. The default is INVENTORY_SIZE
+ *      dense ids.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setItemSpace(ItemId numItems, bool sparse)
+{
+    assert(numItems > 0);
+    itemSpace = numItems;
+    sparseIds = sparse;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setTrace --
+ *
+ *      Record every request the generator issues to writer as
+ *      requests of stream. writer must outlive the generator; NULL
+ *      stops recording.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setTrace(TraceWriter* writer, TraceStream stream)
+{
+    trace       = writer;
+    traceStream = stream;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * itemAt --
+ *
+ *      Return the id of item index of the item space.
+ *
+ * Results:
+ *      An item id.
+ *
+ * ------------------------------------------------------------------
+ */
+ItemId RequestGenerator::
+itemAt(ItemId index) const
+{
+    return sparseIds ? sparse_id(index) : index;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * randomItem --
+ *
+ *      Pick the item id of a request.
+ *
+ * Results:
+ *      An item id.
+ *
+ * ------------------------------------------------------------------
+ */
+ItemId RequestGenerator::
+randomItem()
+{
+    return itemAt(popularity ? popularity->sample() : rand_id(itemSpace));
+}
+
+/*
+ * ------------------------------------------------------------------
+ * nextTask --
+ *
+ *      Generate the next request for store without queueing it,
+ *      for callers that run requests themselves.
+ *
+ * Results:
+ *      The generated Task.
+ *
+ * ------------------------------------------------------------------
+ */
+Task RequestGenerator::
+nextTask(EStore* store)
+{
+    Task task = generateTask(store);
+    taskCount++;
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueTasks --
+ *
+ *      Generate maxTasks requests, or requests forever if maxTasks
+ *      is negative, and enqueue them on the task queue.
+ *
+ *      The generator is open-loop: requests are issued on the
+ *      schedule of the arrival process whether or not the store
+ *      keeps up. The schedule is kept in absolute time, so a
+ *      generator that falls behind issues its overdue requests
+ *      back to back instead of drifting. Each task is stamped with
+ *      the time it was issued, and recorded to the trace, if any,
+ *      before it is enqueued.
+ *
+ *      With a batch size above one, a burst is issued as soon as
+ *      its first request is due and the generator then waits out
+ *      the gaps of the whole burst.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
 void RequestGenerator::
 enqueueTasks(int maxTasks, EStore* store)
 {
+    Task batch[MAX_TASK_BATCH];
+    long long due = sthread_time_ns();
+
     taskCount = 0;
     while (taskCount < maxTasks || maxTasks < 0)
     {
-        taskQueue->enqueue(generateTask(store));
-        taskCount++;
-        sthread_sleep(0, 100000000);
+        long long issued = sthread_time_ns();
+        int n = 0;
+        while (n < batchSize && (taskCount < maxTasks || maxTasks < 0)) {
+            batch[n] = generateTask(store);
+            batch[n].issuedNs = issued;
+            n++;
+            taskCount++;
+            due += arrivals.nextGapNs();
+        }
+
+        if (trace)
+            trace->record(traceStream, batch, n);
+        if (n == 1)
+            taskQueue->enqueue(batch[0]);
+        else
+            taskQueue->enqueueBatch(batch, n);
+
+        long long wait = due - sthread_time_ns();
+        if (wait > 0)
+            sthread_sleep(wait / 1000000000, wait % 1000000000);
     }
 }
 
@@ -78,14 +300,45 @@ enqueueTasks(int maxTasks, EStore* store)
 void RequestGenerator::
 enqueueStops(int num)
 {
-    // TODO: Your code here.
+    for (int i = 0; i < num; i++) {
+        Task task;
+        task.handler = stop_handler;
+        task.arg     = NULL;
+        taskQueue->enqueue(task);
+    }
 }
 
 SupplierRequestGenerator::
-SupplierRequestGenerator(TaskQueue* queue)
+SupplierRequestGenerator(TaskSink* queue)
     : RequestGenerator(queue)
 { }
 
+/*
+ * ------------------------------------------------------------------
+ * fillStore --
+ *
+ *      Add every item of the item space to store directly, with a
+ *      random quantity and price and no discount, so that a run
+ *      starts from a full catalog. The items are recorded to the
+ *      trace, if any, as its fill stream.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void SupplierRequestGenerator::
+fillStore(EStore* store)
+{
+    for (ItemId index = 0; index < itemSpace; index++) {
+        int quantity = rand_quantity();
+        double price = rand_price(MAX_PRICE) + 1;
+        store->addItem(itemAt(index), quantity, price, 0);
+        if (trace)
+            trace->recordFill(itemAt(index), quantity, price, 0);
+    }
+}
+
 Task SupplierRequestGenerator::
 generateTask(EStore* store)
 {
@@ -104,62 +357,67 @@ generateTask(EStore* store)
     {
         case ADD_ITEM:
         {
-            auto req = new AddItemReq();
+            auto req = new_request<AddItemReq>();
             req->store    = store;
-            req->item_id  = rand_id();
+            req->item_id  = randomItem();
             req->price    = rand_price(MAX_PRICE) + 1;
             req->quantity = rand_quantity();
 
-            task.handler = add_item_handler;
-            task.arg     = req;
+            task.handler  = add_item_handler;
+            task.arg      = req;
+            task.affinity = req->item_id;
             break;
         }
         case REMOVE_ITEM:
         {
-            auto req = new RemoveItemReq();
+            auto req = new_request<RemoveItemReq>();
             req->store   = store;
-            req->item_id = rand_id();
+            req->item_id = randomItem();
 
-            task.handler = remove_item_handler;
-            task.arg     = req;
+            task.handler  = remove_item_handler;
+            task.arg      = req;
+            task.affinity = req->item_id;
             break;
         }
         case ADD_STOCK:
         {
-            auto req = new AddStockReq();
+            auto req = new_request<AddStockReq>();
             req->store            = store;
-            req->item_id          = rand_id();
+            req->item_id          = randomItem();
             req->additional_stock = rand_quantity();
 
-            task.handler = add_stock_handler;
-            task.arg     = req;
+            task.handler  = add_stock_handler;
+            task.arg      = req;
+            task.affinity = req->item_id;
             break;
         }
         case CHANGE_ITEM_PRICE:
         {
-            auto req = new ChangeItemPriceReq();
+            auto req = new_request<ChangeItemPriceReq>();
             req->store = store;
-            req->item_id   = rand_id();
+            req->item_id   = randomItem();
             req->new_price = rand_price(MAX_PRICE);
 
-            task.handler = change_item_price_handler;
-            task.arg     = req;
+            task.handler  = change_item_price_handler;
+            task.arg      = req;
+            task.affinity = req->item_id;
             break;
         }
         case CHANGE_ITEM_DISCOUNT:
         {
-            auto req = new ChangeItemDiscountReq();
+            auto req = new_request<ChangeItemDiscountReq>();
             req->store = store;
-            req->item_id      = rand_id();
+            req->item_id      = randomItem();
             req->new_discount = rand_discount();
 
-            task.handler = change_item_discount_handler;
-            task.arg     = req;
+            task.handler  = change_item_discount_handler;
+            task.arg      = req;
+            task.affinity = req->item_id;
             break;
         }
         case SET_SHIPPING_COST:
         {
-            auto req = new SetShippingCostReq();
+            auto req = new_request<SetShippingCostReq>();
             req->store    = store;
             req->new_cost = rand_price(MAX_SHIPPING_COST);
 
@@ -169,7 +427,7 @@ generateTask(EStore* store)
         }
         case SET_STORE_DISCOUNT:
         {
-            auto req = new SetStoreDiscountReq();
+            auto req = new_request<SetStoreDiscountReq>();
             req->store        = store;
             req->new_discount = rand_discount();
 
@@ -189,10 +447,32 @@ generateTask(EStore* store)
 }
 
 CustomerRequestGenerator::
-CustomerRequestGenerator(TaskQueue* queue, bool inFineMode)
-    : RequestGenerator(queue), fineMode(inFineMode)
+CustomerRequestGenerator(TaskSink* queue, bool inFineMode)
+    : RequestGenerator(queue), fineMode(inFineMode), onComplete(NULL),
+      onCompleteContext(NULL)
 { }
 
+/*
+ * ------------------------------------------------------------------
+ * setCompletions --
+ *
+ *      Attach a new Completion with callback and context to every
+ *      purchase the generator issues. The callback owns the
+ *      completion once it is called and must delete it. NULL stops
+ *      attaching completions.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void CustomerRequestGenerator::
+setCompletions(completion_callback_t callback, void* context)
+{
+    onComplete        = callback;
+    onCompleteContext = context;
+}
+
 Task CustomerRequestGenerator::
 generateTask(EStore* store)
 {
@@ -200,30 +480,40 @@ generateTask(EStore* store)
 
     if (!fineMode)
     {
-        auto req = new BuyItemReq();
+        auto req = new_request<BuyItemReq>();
         req->store   = store;
-        req->item_id = rand_id();
+        req->item_id = randomItem();
         req->budget  = rand_price(MAX_BUDGET) + MIN_BUDGET;
+        if (onComplete)
+            req->completion = new Completion(onComplete, onCompleteContext);
 
-        task.handler = buy_item_handler;
-        task.arg     = req;
+        task.handler  = buy_item_handler;
+        task.arg      = req;
+        task.affinity = req->item_id;
     }
     else
     {
-        auto req = new BuyManyItemsReq();
+        auto req = new_request<BuyManyItemsReq>();
 
         int num_buy_item = (sutil_random() % MAX_BUY_ITEM) + 1;
 
-        set<int> order;
-        for (int i = 0; i < num_buy_item; i++)
-            order.insert(rand_id());
+        // Build the order in place, dropping duplicate ids.
+        req->num_items = 0;
+        for (int i = 0; i < num_buy_item; i++) {
+            ItemId id = randomItem();
+            ItemId* end = req->item_ids + req->num_items;
+            if (find(req->item_ids, end, id) == end)
+                req->item_ids[req->num_items++] = id;
+        }
 
         req->store  = store;
-        req->item_ids.insert(req->item_ids.begin(), order.begin(), order.end());
-        req->budget = rand_price(MAX_BUDGET) + MIN_BUDGET;;
+        req->budget = rand_price(MAX_BUDGET) + MIN_BUDGET;
+        if (onComplete)
+            req->completion = new Completion(onComplete, onCompleteContext);
 
-        task.handler = buy_many_items_handler;
-        task.arg     = req;
+        task.handler  = buy_many_items_handler;
+        task.arg      = req;
+        task.affinity = req->item_ids[0];
     }
     return task;
 }
@@ -1,22 +1,41 @@
 #pragma once
 
+#include "Completion.h"
 #include "EStore.h"
+#include "LoadModel.h"
 #include "TaskQueue.h"
+#include "Trace.h"
 #include "Request.h"
 
 class RequestGenerator {
     private:
-    TaskQueue* taskQueue;
+    TaskSink* taskQueue;
+    ArrivalProcess arrivals;
+    const ZipfDistribution* popularity;
+    bool sparseIds;
 
     protected:
+    TraceWriter* trace;
+    TraceStream traceStream;
+
+    ItemId itemSpace;
     int taskCount;
+    int batchSize;
 
+    ItemId itemAt(ItemId index) const;
+    ItemId randomItem();
     virtual Task generateTask(EStore* store) = 0;
 
     public:
-    RequestGenerator(TaskQueue* queue);
+    RequestGenerator(TaskSink* queue);
     virtual ~RequestGenerator();
 
+    void setBatchSize(int size);
+    void setArrivals(ArrivalKind kind, double ratePerSec);
+    void setItemPopularity(const ZipfDistribution* zipf);
+    void setItemSpace(ItemId numItems, bool sparse);
+    void setTrace(TraceWriter* writer, TraceStream stream);
+    Task nextTask(EStore* store);
     void enqueueTasks(int maxTasks, EStore* store);
     void enqueueStops(int num);
 };
@@ -26,17 +45,23 @@ class SupplierRequestGenerator : public RequestGenerator {
     virtual Task generateTask(EStore* store);
 
     public:
-    SupplierRequestGenerator(TaskQueue* queue);
+    SupplierRequestGenerator(TaskSink* queue);
+
+    void fillStore(EStore* store);
 };
 
 class CustomerRequestGenerator : public RequestGenerator {
     private:
     bool fineMode;
+    completion_callback_t onComplete;
+    void* onCompleteContext;
 
     protected:
     virtual Task generateTask(EStore* store);
 
     public:
-    CustomerRequestGenerator(TaskQueue* queue, bool inFineMode);
+    CustomerRequestGenerator(TaskSink* queue, bool inFineMode);
+
+    void setCompletions(completion_callback_t callback, void* context);
 };
 
@@ -1,3 +1,10 @@
+#include "Completion.h"
+#include "Coroutine.h"
+#include "EStore.h"
+#include "Request.h"
+#include "RequestHandlers.h"
+#include "RequestPool.h"
+#include "sthread.h"
 
 /*
  * ------------------------------------------------------------------
@@ -5,7 +12,7 @@
  *
  *      Handle an AddItemReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -15,7 +22,11 @@
 void 
 add_item_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<AddItemReq*>(args);
+
+    req->store->addItem(req->item_id, req->quantity, req->price, req->discount);
+
+    delete_request(req);
 }
 
 /*
@@ -24,7 +35,7 @@ add_item_handler(void *args)
  *
  *      Handle a RemoveItemReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -34,7 +45,11 @@ add_item_handler(void *args)
 void 
 remove_item_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<RemoveItemReq*>(args);
+
+    req->store->removeItem(req->item_id);
+
+    delete_request(req);
 }
 
 /*
@@ -43,7 +58,7 @@ remove_item_handler(void *args)
  *
  *      Handle an AddStockReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -53,7 +68,11 @@ remove_item_handler(void *args)
 void 
 add_stock_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<AddStockReq*>(args);
+
+    req->store->addStock(req->item_id, req->additional_stock);
+
+    delete_request(req);
 }
 
 /*
@@ -62,7 +81,7 @@ add_stock_handler(void *args)
  *
  *      Handle a ChangeItemPriceReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -72,7 +91,11 @@ add_stock_handler(void *args)
 void 
 change_item_price_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<ChangeItemPriceReq*>(args);
+
+    req->store->priceItem(req->item_id, req->new_price);
+
+    delete_request(req);
 }
 
 /*
@@ -81,7 +104,7 @@ change_item_price_handler(void *args)
  *
  *      Handle a ChangeItemDiscountReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -91,7 +114,11 @@ change_item_price_handler(void *args)
 void 
 change_item_discount_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<ChangeItemDiscountReq*>(args);
+
+    req->store->discountItem(req->item_id, req->new_discount);
+
+    delete_request(req);
 }
 
 /*
@@ -100,7 +127,7 @@ change_item_discount_handler(void *args)
  *
  *      Handle a SetShippingCostReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -110,7 +137,11 @@ change_item_discount_handler(void *args)
 void 
 set_shipping_cost_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<SetShippingCostReq*>(args);
+
+    req->store->setShippingCost(req->new_cost);
+
+    delete_request(req);
 }
 
 /*
@@ -119,7 +150,7 @@ set_shipping_cost_handler(void *args)
  *
  *      Handle a SetStoreDiscountReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done.
  *
  * Results:
  *      None.
@@ -129,7 +160,65 @@ set_shipping_cost_handler(void *args)
 void
 set_store_discount_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<SetStoreDiscountReq*>(args);
+
+    req->store->setStoreDiscount(req->new_discount);
+
+    delete_request(req);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * update_item_handler --
+ *
+ *      Handle an UpdateItemReq.
+ *
+ *      Return the request object to its pool when done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+update_item_handler(void *args)
+{
+    auto req = static_cast<UpdateItemReq*>(args);
+
+    req->store->updateItem(req->item_id, req->additional_stock,
+                           req->set_price, req->new_price,
+                           req->set_discount, req->new_discount);
+
+    delete_request(req);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buy_item_coroutine --
+ *
+ *      Run a BuyItemReq as a coroutine, for a store with coroutines
+ *      enabled. The coroutine returns to the handler's caller the
+ *      first time the purchase suspends, and once the purchase is
+ *      decided, on whichever thread resumed it, it finishes the
+ *      request as buy_item_handler does.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static DetachedCoroutine
+buy_item_coroutine(BuyItemReq* req)
+{
+    Completion* completion = req->completion;
+    long long start = completion ? sthread_time_ns() : 0;
+
+    bool bought = co_await req->store->buyItemAsync(req->item_id,
+                                                    req->budget);
+
+    delete_request(req);
+    if (completion)
+        completion->complete(bought, start);
 }
 
 /*
@@ -138,7 +227,11 @@ set_store_discount_handler(void *args)
  *
  *      Handle a BuyItemReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done, then
+ *      complete the request's completion, if any. If the store
+ *      runs purchases as coroutines, the request is finished by
+ *      buy_item_coroutine instead, possibly after the handler has
+ *      returned.
  *
  * Results:
  *      None.
@@ -148,7 +241,46 @@ set_store_discount_handler(void *args)
 void
 buy_item_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<BuyItemReq*>(args);
+    if (req->store->coroutinesEnabled()) {
+        buy_item_coroutine(req);
+        return;
+    }
+
+    Completion* completion = req->completion;
+    long long start = completion ? sthread_time_ns() : 0;
+
+    bool bought = req->store->buyItem(req->item_id, req->budget);
+
+    delete_request(req);
+    if (completion)
+        completion->complete(bought, start);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buy_many_items_coroutine --
+ *
+ *      Run a BuyManyItemsReq as a coroutine; see
+ *      buy_item_coroutine.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static DetachedCoroutine
+buy_many_items_coroutine(BuyManyItemsReq* req)
+{
+    Completion* completion = req->completion;
+    long long start = completion ? sthread_time_ns() : 0;
+
+    bool bought = co_await req->store->buyManyItemsAsync(
+        req->item_ids, req->num_items, req->budget);
+
+    delete_request(req);
+    if (completion)
+        completion->complete(bought, start);
 }
 
 /*
@@ -157,7 +289,10 @@ buy_item_handler(void *args)
  *
  *      Handle a BuyManyItemsReq.
  *
- *      Delete the request object when done.
+ *      Return the request object to its pool when done, then
+ *      complete the request's completion, if any. If the store
+ *      runs purchases as coroutines, the request is finished by
+ *      buy_many_items_coroutine instead.
  *
  * Results:
  *      None.
@@ -167,7 +302,21 @@ buy_item_handler(void *args)
 void
 buy_many_items_handler(void *args)
 {
-    // TODO: Your code here.
+    auto req = static_cast<BuyManyItemsReq*>(args);
+    if (req->store->coroutinesEnabled()) {
+        buy_many_items_coroutine(req);
+        return;
+    }
+
+    Completion* completion = req->completion;
+    long long start = completion ? sthread_time_ns() : 0;
+
+    bool bought = req->store->buyManyItems(req->item_ids, req->num_items,
+                                           req->budget);
+
+    delete_request(req);
+    if (completion)
+        completion->complete(bought, start);
 }
 
 /*
@@ -184,6 +333,40 @@ buy_many_items_handler(void *args)
 void 
 stop_handler(void* args)
 {
-    // TODO: Your code here.
+    sthread_exit();
 }
 
+
+/*
+ * The handler and report name of every request type, in order.
+ */
+static const struct {
+    void (*handler)(void *);
+    const char* name;
+} requestTypes[NUM_REQUEST_TYPES] = {
+    { add_item_handler,             "add item" },
+    { remove_item_handler,          "remove item" },
+    { add_stock_handler,            "add stock" },
+    { change_item_price_handler,    "item price" },
+    { change_item_discount_handler, "item discount" },
+    { set_shipping_cost_handler,    "shipping cost" },
+    { set_store_discount_handler,   "store discount" },
+    { update_item_handler,          "item update" },
+    { buy_item_handler,             "buy item" },
+    { buy_many_items_handler,       "buy many items" },
+};
+
+int
+request_type(void (*handler)(void *))
+{
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++)
+        if (requestTypes[t].handler == handler)
+            return t;
+    return -1;
+}
+
+const char*
+request_type_name(int type)
+{
+    return requestTypes[type].name;
+}
@@ -7,8 +7,17 @@ void change_item_price_handler(void *args);
 void change_item_discount_handler(void *args);
 void set_shipping_cost_handler(void *args);
 void set_store_discount_handler(void *args);
+void update_item_handler(void *args);
 
 void buy_item_handler(void *args);
 void buy_many_items_handler(void *args);
 
 void stop_handler(void *args);
+
+/*
+ * Map a handler to the request type it handles (see Request.h) and
+ * a request type to a short name for reports. request_type returns
+ * -1 for handlers that are not requests, such as stop_handler.
+ */
+int request_type(void (*handler)(void *));
+const char* request_type_name(int type);
@@ -0,0 +1,175 @@
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include "RequestPool.h"
+
+using namespace std;
+
+/*
+ * Pools whose thread has exited, waiting to be adopted by a new
+ * thread. Taken once per thread, so a plain lock is enough.
+ */
+static struct IdlePools {
+    smutex_t lock;
+    RequestPool* head;
+
+    IdlePools() : head(NULL)
+    {
+        smutex_init(&lock);
+        sthread_profile_name(&lock, "RequestPool::idle");
+    }
+} idlePools;
+
+/*
+ * Owns the calling thread's pool and parks it on idlePools when the
+ * thread exits.
+ */
+struct RequestPoolOwner {
+    RequestPool* pool;
+
+    RequestPoolOwner() : pool(NULL) { }
+    ~RequestPoolOwner()
+    {
+        if (pool == NULL)
+            return;
+        smutex_lock(&idlePools.lock);
+        pool->nextIdle = idlePools.head;
+        idlePools.head = pool;
+        smutex_unlock(&idlePools.lock);
+    }
+};
+
+static thread_local RequestPoolOwner owner;
+
+RequestPool::
+RequestPool()
+    : localFree(NULL), nextIdle(NULL), remoteFree(NULL)
+{ }
+
+/*
+ * ------------------------------------------------------------------
+ * forThisThread --
+ *
+ *      Return the calling thread's pool, adopting an idle pool or
+ *      creating a new one the first time the thread allocates.
+ *
+ * Results:
+ *      The calling thread's pool.
+ *
+ * ------------------------------------------------------------------
+ */
+RequestPool* RequestPool::
+forThisThread()
+{
+    if (owner.pool != NULL)
+        return owner.pool;
+
+    smutex_lock(&idlePools.lock);
+    RequestPool* pool = idlePools.head;
+    if (pool != NULL)
+        idlePools.head = pool->nextIdle;
+    smutex_unlock(&idlePools.lock);
+
+    if (pool == NULL)
+        pool = new RequestPool();
+    pool->nextIdle = NULL;
+    owner.pool = pool;
+    return pool;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * take --
+ *
+ *      Take a free block from this pool. The private free list is
+ *      used first, then the blocks other threads have returned,
+ *      and only then is a new slab carved. Called by the owning
+ *      thread only.
+ *
+ * Results:
+ *      A free block.
+ *
+ * ------------------------------------------------------------------
+ */
+RequestPool::Block* RequestPool::
+take()
+{
+    if (localFree == NULL)
+        localFree = remoteFree.exchange(NULL, memory_order_acquire);
+
+    if (localFree == NULL) {
+        Block* slab = static_cast<Block*>(malloc(REQUEST_SLAB_BLOCKS *
+                                                 sizeof(Block)));
+        if (slab == NULL) {
+            perror("request slab allocation failed");
+            exit(-1);
+        }
+        for (int i = 0; i < REQUEST_SLAB_BLOCKS; i++) {
+            slab[i].home = this;
+            slab[i].next = i + 1 < REQUEST_SLAB_BLOCKS ? &slab[i + 1] : NULL;
+        }
+        localFree = slab;
+    }
+
+    Block* block = localFree;
+    localFree = block->next;
+    return block;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * allocate --
+ *
+ *      Allocate room for a request of size bytes from the calling
+ *      thread's pool.
+ *
+ * Results:
+ *      Uninitialized memory for the request.
+ *
+ * ------------------------------------------------------------------
+ */
+void* RequestPool::
+allocate(size_t size)
+{
+    assert(size <= MAX_REQUEST_SIZE);
+    return forThisThread()->take()->data;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * free --
+ *
+ *      Return a request allocated by allocate to its home pool. If
+ *      the calling thread owns that pool the block goes onto the
+ *      private free list, otherwise it is pushed onto the pool's
+ *      remoteFree stack.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestPool::
+free(void* ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    Block* block = reinterpret_cast<Block*>(
+        static_cast<unsigned char*>(ptr) - offsetof(Block, data));
+    RequestPool* home = block->home;
+
+    if (home == owner.pool) {
+        block->next = home->localFree;
+        home->localFree = block;
+        return;
+    }
+
+    Block* top = home->remoteFree.load(memory_order_relaxed);
+    do {
+        block->next = top;
+    } while (!home->remoteFree.compare_exchange_weak(top, block,
+                                                     memory_order_release,
+                                                     memory_order_relaxed));
+}
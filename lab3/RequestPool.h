@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+#include "sthread.h"
+
+/*
+ * Number of request blocks carved out of one slab, and the size of
+ * the largest request a block can hold.
+ */
+#define REQUEST_SLAB_BLOCKS 256
+#define MAX_REQUEST_SIZE    96
+
+/*
+ * ------------------------------------------------------------------
+ * RequestPool --
+ *
+ *      A per-thread slab allocator for request objects.
+ *
+ *      Every thread that allocates requests owns one pool. Blocks
+ *      come from slabs of REQUEST_SLAB_BLOCKS fixed-size blocks and
+ *      each block remembers its home pool. A block freed by the
+ *      owning thread goes straight back onto the pool's private
+ *      free list. A block freed by any other thread is pushed onto
+ *      the pool's remoteFree stack with a compare-and-swap, and the
+ *      owner takes the whole stack back with one exchange when its
+ *      private list runs out. Only the owner pops from remoteFree,
+ *      and it always takes the whole stack, so the push cannot
+ *      suffer from ABA.
+ *
+ *      A pool outlives its thread: blocks may still be in flight
+ *      when the thread exits. The pool of an exited thread is
+ *      parked on a global list and adopted by the next thread that
+ *      needs one. Slabs are never returned to the system.
+ *
+ * ------------------------------------------------------------------
+ */
+class RequestPool {
+    private:
+    struct Block {
+        RequestPool* home;
+        Block* next;
+        alignas(std::max_align_t) unsigned char data[MAX_REQUEST_SIZE];
+    };
+
+    Block* localFree;
+    RequestPool* nextIdle;
+    alignas(CACHE_LINE_SIZE) std::atomic<Block*> remoteFree;
+
+    RequestPool();
+
+    Block* take();
+    static RequestPool* forThisThread();
+
+    friend struct RequestPoolOwner;
+
+    public:
+    // no default copy constructor and assignment operators. this will prevent some
+    // painful bugs by converting them into compiler errors.
+    RequestPool(const RequestPool&) = delete;
+    RequestPool& operator=(const RequestPool &) = delete;
+
+    static void* allocate(size_t size);
+    static void free(void* ptr);
+};
+
+/*
+ * Allocate and construct a request of type T from the calling
+ * thread's pool, and destroy one and return it to its home pool
+ * from any thread.
+ */
+template <typename T>
+T* new_request()
+{
+    static_assert(sizeof(T) <= MAX_REQUEST_SIZE, "request too large");
+    return new (RequestPool::allocate(sizeof(T))) T();
+}
+
+template <typename T>
+void delete_request(T* req)
+{
+    req->~T();
+    RequestPool::free(req);
+}
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cassert>
+#include <string>
+
+#include "ShardedTaskQueue.h"
+
+using namespace std;
+
+ShardedTaskQueue::
+ShardedTaskQueue(int numShards, ShardPolicy shardPolicy, TaskQueueKind kind)
+    : policy(shardPolicy), nextShard(0), queued(0), sleepers(0),
+      closed(false)
+{
+    assert(numShards > 0);
+
+    for (int i = 0; i < numShards; i++) {
+        TaskQueue* shard = new TaskQueue(kind);
+        shard->setProfileName(
+            ("TaskShard[" + to_string(i) + "]").c_str());
+        shards.push_back(shard);
+    }
+    smutex_init(&mutex);
+    scond_init(&notEmpty);
+    sthread_profile_name(&mutex, "ShardedTaskQueue::mutex");
+    sthread_profile_name(&notEmpty, "ShardedTaskQueue::notEmpty");
+}
+
+ShardedTaskQueue::
+~ShardedTaskQueue()
+{
+    scond_destroy(&notEmpty);
+    smutex_destroy(&mutex);
+    for (TaskQueue* shard : shards)
+        delete shard;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * shardOf --
+ *
+ *      Pick the shard for task.
+ *
+ * Results:
+ *      The shard index.
+ *
+ * ------------------------------------------------------------------
+ */
+int ShardedTaskQueue::
+shardOf(const Task& task)
+{
+    if (policy == HASH_SHARDS) {
+        uint64_t h = task.affinity * 0x9e3779b97f4a7c15ULL;
+        return (h >> 32) % shards.size();
+    }
+    return nextShard.fetch_add(1, memory_order_relaxed) % shards.size();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * published --
+ *
+ *      Called after n tasks were put in the shards: count them and
+ *      wake sleeping consumers if there are any.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedTaskQueue::
+published(int n)
+{
+    queued.fetch_add(n);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleepers.load(memory_order_relaxed) > 0) {
+        smutex_lock(&mutex);
+        if (n == 1)
+            scond_signal(&notEmpty, &mutex);
+        else
+            scond_broadcast(&notEmpty, &mutex);
+        smutex_unlock(&mutex);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueue --
+ *
+ *      Insert the task at the back of its shard.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedTaskQueue::
+enqueue(Task task)
+{
+    shards[shardOf(task)]->enqueue(task);
+    published(1);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueBatch --
+ *
+ *      Insert the n tasks of batch. With ROUND_ROBIN_SHARDS the
+ *      whole batch goes to one shard, in order. With HASH_SHARDS the
+ *      tasks are grouped by shard and each group is inserted with
+ *      one call, keeping the order of the tasks within a shard.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ShardedTaskQueue::
+enqueueBatch(const Task* batch, int n)
+{
+    if (n <= 0)
+        return;
+
+    if (policy == ROUND_ROBIN_SHARDS) {
+        int shard = nextShard.fetch_add(1, memory_order_relaxed) %
+                    shards.size();
+        shards[shard]->enqueueBatch(batch, n);
+        published(n);
+        return;
+    }
+
+    int shardOfTask[MAX_TASK_BATCH];
+    Task group[MAX_TASK_BATCH];
+    for (int start = 0; start < n; start += MAX_TASK_BATCH) {
+        int count = min(n - start, MAX_TASK_BATCH);
+        for (int i = 0; i < count; i++)
+            shardOfTask[i] = shardOf(batch[start + i]);
+
+        int placed = 0;
+        for (int i = 0; placed < count; i++) {
+            if (shardOfTask[i] < 0)
+                continue;
+            int shard = shardOfTask[i];
+            int size = 0;
+            for (int j = i; j < count; j++) {
+                if (shardOfTask[j] == shard) {
+                    group[size++] = batch[start + j];
+                    shardOfTask[j] = -1;
+                }
+            }
+            shards[shard]->enqueueBatch(group, size);
+            placed += size;
+        }
+    }
+    published(n);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeue --
+ *
+ *      Remove a task for the consumer whose home shard is home,
+ *      blocking until there is one or the queue is closed.
+ *
+ * Results:
+ *      The Task, or a Task with a NULL handler if the queue is
+ *      closed and empty.
+ *
+ * ------------------------------------------------------------------
+ */
+Task ShardedTaskQueue::
+dequeue(int home)
+{
+    Task task = { NULL, NULL };
+    dequeueUpTo(home, &task, 1);
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeueUpTo --
+ *
+ *      Remove up to max tasks for the consumer whose home shard is
+ *      home, all from one shard: its home shard if it has any,
+ *      otherwise the first other shard that does. If every shard is
+ *      empty, block until a task is inserted or the queue is closed.
+ *
+ * Results:
+ *      The number of Tasks stored in batch, at least 1 unless the
+ *      queue is closed and empty.
+ *
+ * ------------------------------------------------------------------
+ */
+int ShardedTaskQueue::
+dequeueUpTo(int home, Task* batch, int max)
+{
+    int numShards = shards.size();
+    assert(home >= 0 && home < numShards);
+
+    while (true) {
+        for (int i = 0; i < numShards; i++) {
+            int n = shards[(home + i) % numShards]->tryDequeueUpTo(batch, max);
+            if (n > 0) {
+                queued.fetch_sub(n, memory_order_relaxed);
+                if (i == 0)
+                    stats.localBatches.fetch_add(1, memory_order_relaxed);
+                else
+                    stats.stolenBatches.fetch_add(1, memory_order_relaxed);
+                return n;
+            }
+        }
+
+        smutex_lock(&mutex);
+        sleepers.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (queued.load(memory_order_relaxed) <= 0 &&
+            !closed.load(memory_order_relaxed)) {
+            stats.sleeps.fetch_add(1, memory_order_relaxed);
+            while (queued.load(memory_order_relaxed) <= 0 &&
+                   !closed.load(memory_order_relaxed))
+                scond_wait(&notEmpty, &mutex);
+        }
+        sleepers.fetch_sub(1);
+        bool drained = closed.load(memory_order_relaxed) &&
+                       queued.load(memory_order_relaxed) <= 0;
+        smutex_unlock(&mutex);
+        if (drained)
+            return 0;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * close --
+ *
+ *      Close every shard and wake every sleeping consumer.
+ *
+ * Results:
+ *      The number of tasks still queued in all shards when the
+ *      queue closed.
+ *
+ * ------------------------------------------------------------------
+ */
+int ShardedTaskQueue::
+close()
+{
+    int pending = 0;
+    for (TaskQueue* shard : shards)
+        pending += shard->close();
+
+    smutex_lock(&mutex);
+    closed.store(true);
+    scond_broadcast(&notEmpty, &mutex);
+    smutex_unlock(&mutex);
+    return pending;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "sthread.h"
+#include "TaskQueue.h"
+
+/*
+ * How a ShardedTaskQueue spreads tasks over its shards.
+ * ROUND_ROBIN_SHARDS deals each enqueue call to the next shard;
+ * HASH_SHARDS sends each task to the shard its affinity hashes to,
+ * so that the requests for one item are run by the same consumers.
+ */
+enum ShardPolicy {
+    ROUND_ROBIN_SHARDS = 0,
+    HASH_SHARDS
+};
+
+/*
+ * Counters describing how consumers found their tasks.
+ */
+struct ShardStats {
+    std::atomic<long> localBatches;
+    std::atomic<long> stolenBatches;
+    std::atomic<long> sleeps;
+
+    ShardStats() : localBatches(0), stolenBatches(0), sleeps(0) { }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ShardedTaskQueue --
+ *
+ *      A task queue split into several TaskQueues, the shards, so
+ *      that producers and consumers working on different shards do
+ *      not share the queue's locks and cache lines.
+ *
+ *      Every consumer has a home shard, passed to dequeue, and takes
+ *      its tasks from there while it has any. When its home shard
+ *      is empty it steals from the others, starting with the next
+ *      one. Tasks in different shards are not ordered with respect
+ *      to each other.
+ *
+ *      queued counts the tasks in all shards. A consumer that finds
+ *      every shard empty sleeps on the queue's own mutex until it is
+ *      non-zero; see TaskQueue::ringEnqueue for why announcing
+ *      sleepers and publishing tasks, each followed by a full
+ *      fence, cannot lose a wakeup. A consumer may take tasks
+ *      before their producer has counted them, so queued can dip
+ *      below zero for a moment; pending() reports it as zero.
+ *
+ *      close() closes every shard and wakes the sleepers; like a
+ *      closed TaskQueue, the queue then hands out the tasks it still
+ *      holds and after that returns no task at all.
+ *
+ * ------------------------------------------------------------------
+ */
+class ShardedTaskQueue : public TaskSink {
+    private:
+    const ShardPolicy policy;
+    std::vector<TaskQueue*> shards;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned long> nextShard;
+    alignas(CACHE_LINE_SIZE) std::atomic<long> queued;
+    std::atomic<int> sleepers;
+    std::atomic<bool> closed;
+    smutex_t mutex;
+    scond_t notEmpty;
+
+    ShardStats stats;
+
+    int shardOf(const Task& task);
+    void published(int n);
+
+    public:
+    ShardedTaskQueue(int numShards, ShardPolicy shardPolicy,
+                     TaskQueueKind kind = MONITOR_QUEUE);
+    ~ShardedTaskQueue();
+
+    // no default copy constructor and assignment operators. this will prevent some
+    // painful bugs by converting them into compiler errors.
+    ShardedTaskQueue(const ShardedTaskQueue&) = delete;
+    ShardedTaskQueue& operator=(const ShardedTaskQueue &) = delete;
+
+    void enqueue(Task task) override;
+    void enqueueBatch(const Task* batch, int n) override;
+
+    Task dequeue(int home);
+    int dequeueUpTo(int home, Task* batch, int max);
+
+    int close();
+    long pending() const
+    {
+        return std::max(queued.load(std::memory_order_relaxed), 0L);
+    }
+
+    int numShards() const { return shards.size(); }
+    const ShardStats& getStats() const { return stats; }
+};
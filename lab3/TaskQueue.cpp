@@ -1,23 +1,76 @@
 
+#include <algorithm>
+#include <cassert>
+#include <string>
+
 #include "TaskQueue.h"
 
+using namespace std;
+
 TaskQueue::
-TaskQueue()
+TaskQueue(TaskQueueKind queueKind, size_t ringCapacity)
+    : kind(queueKind), ring(NULL), ringMask(0), tail(0), head(0),
+      waitingConsumers(0), waitingProducers(0), closed(false)
 {
-    // TODO: Your code here.
+    smutex_init(&mutex);
+    scond_init(&notEmpty);
+    scond_init(&notFull);
+    setProfileName("TaskQueue");
+
+    if (kind == RING_QUEUE) {
+        size_t capacity = 1;
+        while (capacity < ringCapacity)
+            capacity <<= 1;
+
+        ring = new RingCell[capacity];
+        for (size_t i = 0; i < capacity; i++)
+            ring[i].seq.store(i, memory_order_relaxed);
+        ringMask = capacity - 1;
+    }
 }
 
 TaskQueue::
 ~TaskQueue()
 {
-    // TODO: Your code here.
+    delete[] ring;
+
+    scond_destroy(&notFull);
+    scond_destroy(&notEmpty);
+    smutex_destroy(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setProfileName --
+ *
+ *      Name the queue's mutex and condition variables name::mutex,
+ *      name::notEmpty and name::notFull in the lock profile, so
+ *      that the queues of a program can be told apart. Queues are
+ *      named TaskQueue until renamed.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+setProfileName(const char* name)
+{
+    string prefix(name);
+    sthread_profile_name(&mutex, (prefix + "::mutex").c_str());
+    sthread_profile_name(&notEmpty, (prefix + "::notEmpty").c_str());
+    sthread_profile_name(&notFull, (prefix + "::notFull").c_str());
 }
 
 /*
  * ------------------------------------------------------------------
  * size --
  *
- *      Return the current size of the queue.
+ *      Return the current size of the queue. The caller must hold
+ *      the queue mutex. For a ring the result is only a snapshot,
+ *      as the ring changes without the mutex: head is read before
+ *      tail so that consumers cannot move it past the tail read,
+ *      and producers racing ahead are clamped to the capacity.
  *
  * Results:
  *      The size of the queue.
@@ -27,15 +80,22 @@ TaskQueue::
 int TaskQueue::
 size()
 {
-    // TODO: Your code here.
-    return -999; // Keep compiler happy until routine done.
+    if (kind == RING_QUEUE) {
+        size_t first = head.load();
+        size_t last = tail.load();
+        if (last <= first)
+            return 0;
+        return min(last - first, ringMask + 1);
+    }
+    return tasks.size();
 }
 
 /*
  * ------------------------------------------------------------------
  * empty --
  *
- *      Return whether or not the queue is empty.
+ *      Return whether or not the queue is empty. The caller must
+ *      hold the queue mutex.
  *
  * Results:
  *      The true if the queue is empty and false otherwise.
@@ -45,8 +105,7 @@ size()
 bool TaskQueue::
 empty()
 {
-    // TODO: Your code here.
-    return false; // Keep compiler happy until routine done.
+    return size() == 0;
 }
 
 /*
@@ -63,7 +122,17 @@ empty()
 void TaskQueue::
 enqueue(Task task)
 {
-    // TODO: Your code here.
+    assert(!closed.load(memory_order_relaxed));
+
+    if (kind == RING_QUEUE) {
+        ringEnqueue(task);
+        return;
+    }
+
+    smutex_lock(&mutex);
+    tasks.push(task);
+    scond_signal(&notEmpty, &mutex);
+    smutex_unlock(&mutex);
 }
 
 /*
@@ -71,17 +140,411 @@ enqueue(Task task)
  * dequeue --
  *
  *      Remove the Task at the front of the queue and return it.
- *      If the queue is empty, block until a Task is inserted.
+ *      If the queue is empty, block until a Task is inserted or the
+ *      queue is closed.
  *
  * Results:
- *      The Task at the front of the queue.
+ *      The Task at the front of the queue, or a Task with a NULL
+ *      handler if the queue is closed and empty.
  *
  * ------------------------------------------------------------------
  */
 Task TaskQueue::
 dequeue()
 {
-    // TODO: Your code here.
-    return Task(); // Keep compiler happy until routine done.
+    if (kind == RING_QUEUE)
+        return ringDequeue();
+
+    Task task = { NULL, NULL };
+    smutex_lock(&mutex);
+    while (empty() && !closed.load(memory_order_relaxed)) {
+        waitingConsumers.fetch_add(1, memory_order_relaxed);
+        scond_wait(&notEmpty, &mutex);
+        waitingConsumers.fetch_sub(1, memory_order_relaxed);
+    }
+    if (!empty()) {
+        task = tasks.front();
+        tasks.pop();
+    }
+    smutex_unlock(&mutex);
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueBatch --
+ *
+ *      Insert the n tasks of batch at the back of the queue, in
+ *      order, and wake up to n blocked consumers.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+enqueueBatch(const Task* batch, int n)
+{
+    if (n <= 0)
+        return;
+    assert(!closed.load(memory_order_relaxed));
+
+    if (kind == RING_QUEUE) {
+        int pushed = 0;
+        while (pushed < n && ringTryPush(batch[pushed]))
+            pushed++;
+        if (pushed > 0)
+            ringWakeConsumers(pushed);
+        for (; pushed < n; pushed++)
+            ringEnqueue(batch[pushed]);
+        return;
+    }
+
+    smutex_lock(&mutex);
+    for (int i = 0; i < n; i++)
+        tasks.push(batch[i]);
+    wakeConsumers(n);
+    smutex_unlock(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeueUpTo --
+ *
+ *      Remove up to max Tasks from the front of the queue and store
+ *      them, in order, in batch. If the queue is empty, block until
+ *      a Task is inserted or the queue is closed; after that take
+ *      only what is already there.
+ *
+ * Results:
+ *      The number of Tasks stored in batch, at least 1 unless the
+ *      queue is closed and empty.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+dequeueUpTo(Task* batch, int max)
+{
+    assert(max > 0);
+
+    if (kind == RING_QUEUE) {
+        batch[0] = ringDequeue();
+        if (batch[0].handler == NULL)
+            return 0;
+        int n = 1;
+        while (n < max && ringTryPop(&batch[n]))
+            n++;
+        if (n > 1) {
+            atomic_thread_fence(memory_order_seq_cst);
+            if (waitingProducers.load(memory_order_relaxed) > 0) {
+                smutex_lock(&mutex);
+                scond_broadcast(&notFull, &mutex);
+                smutex_unlock(&mutex);
+            }
+        }
+        return n;
+    }
+
+    smutex_lock(&mutex);
+    while (empty() && !closed.load(memory_order_relaxed)) {
+        waitingConsumers.fetch_add(1, memory_order_relaxed);
+        scond_wait(&notEmpty, &mutex);
+        waitingConsumers.fetch_sub(1, memory_order_relaxed);
+    }
+    int n = 0;
+    while (n < max && !empty()) {
+        batch[n++] = tasks.front();
+        tasks.pop();
+    }
+    smutex_unlock(&mutex);
+    return n;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryDequeueUpTo --
+ *
+ *      Like dequeueUpTo, but never block: if the queue is empty,
+ *      return at once.
+ *
+ * Results:
+ *      The number of Tasks stored in batch, 0 if there were none.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+tryDequeueUpTo(Task* batch, int max)
+{
+    assert(max > 0);
+
+    if (kind == RING_QUEUE) {
+        int n = 0;
+        while (n < max && ringTryPop(&batch[n]))
+            n++;
+        if (n > 0) {
+            atomic_thread_fence(memory_order_seq_cst);
+            if (waitingProducers.load(memory_order_relaxed) > 0) {
+                smutex_lock(&mutex);
+                scond_broadcast(&notFull, &mutex);
+                smutex_unlock(&mutex);
+            }
+        }
+        return n;
+    }
+
+    smutex_lock(&mutex);
+    int n = 0;
+    while (n < max && !empty()) {
+        batch[n++] = tasks.front();
+        tasks.pop();
+    }
+    smutex_unlock(&mutex);
+    return n;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * close --
+ *
+ *      Close the queue and wake every blocked consumer. The tasks
+ *      still queued are handed out as usual; see TaskQueue.
+ *
+ * Results:
+ *      The number of tasks still queued when the queue closed.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+close()
+{
+    smutex_lock(&mutex);
+    closed.store(true);
+    int queued = size();
+    scond_broadcast(&notEmpty, &mutex);
+    smutex_unlock(&mutex);
+    return queued;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * pending --
+ *
+ *      Return the number of tasks in the queue. For a ring the
+ *      result is only a snapshot.
+ *
+ * Results:
+ *      The number of queued tasks.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+pending()
+{
+    smutex_lock(&mutex);
+    int queued = size();
+    smutex_unlock(&mutex);
+    return queued;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ringTryPush --
+ *
+ *      Try to append the task to the ring without blocking. Each
+ *      cell's seq says whose turn it is: a producer may fill the
+ *      cell at position pos when seq == pos, and a consumer may
+ *      empty it when seq == pos + 1.
+ *
+ * Results:
+ *      True if the task was appended, false if the ring is full.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+ringTryPush(const Task& task)
+{
+    size_t pos = tail.load(memory_order_relaxed);
+    while (true) {
+        RingCell& cell = ring[pos & ringMask];
+        size_t seq = cell.seq.load(memory_order_acquire);
+        long diff = (long) seq - (long) pos;
+
+        if (diff == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1,
+                                           memory_order_relaxed)) {
+                cell.task = task;
+                cell.seq.store(pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = tail.load(memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ringTryPop --
+ *
+ *      Try to remove the task at the front of the ring without
+ *      blocking. See ringTryPush for the cell protocol.
+ *
+ * Results:
+ *      True and the task in *task, or false if the ring is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+ringTryPop(Task* task)
+{
+    size_t pos = head.load(memory_order_relaxed);
+    while (true) {
+        RingCell& cell = ring[pos & ringMask];
+        size_t seq = cell.seq.load(memory_order_acquire);
+        long diff = (long) seq - (long) (pos + 1);
+
+        if (diff == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1,
+                                           memory_order_relaxed)) {
+                *task = cell.task;
+                cell.seq.store(pos + ringMask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = head.load(memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ringEnqueue --
+ *
+ *      Append the task to the ring, sleeping while the ring is
+ *      full, then wake a sleeping consumer if there is one.
+ *
+ *      A thread that is about to sleep first announces itself in
+ *      waitingConsumers or waitingProducers and then retries under
+ *      the mutex. The other side publishes its change and then
+ *      reads the count, with a full fence in between on both sides,
+ *      so either the sleeper's retry sees the change or the other
+ *      side sees the sleeper and signals it under the mutex.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+ringEnqueue(Task task)
+{
+    if (!ringTryPush(task)) {
+        smutex_lock(&mutex);
+        waitingProducers.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!ringTryPush(task))
+            scond_wait(&notFull, &mutex);
+        waitingProducers.fetch_sub(1);
+        smutex_unlock(&mutex);
+    }
+
+    ringWakeConsumers(1);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ringDequeue --
+ *
+ *      Remove the task at the front of the ring, sleeping while the
+ *      ring is empty and open, then wake a sleeping producer if
+ *      there is one. See ringEnqueue for how sleeping works. close
+ *      sets closed under the mutex, so a consumer that checks it
+ *      under the mutex before sleeping cannot miss it.
+ *
+ * Results:
+ *      The Task at the front of the ring, or a Task with a NULL
+ *      handler if the ring is closed and empty.
+ *
+ * ------------------------------------------------------------------
+ */
+Task TaskQueue::
+ringDequeue()
+{
+    Task task;
+
+    if (!ringTryPop(&task)) {
+        bool popped = true;
+        smutex_lock(&mutex);
+        waitingConsumers.fetch_add(1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!ringTryPop(&task)) {
+            if (closed.load(memory_order_relaxed)) {
+                popped = false;
+                break;
+            }
+            scond_wait(&notEmpty, &mutex);
+        }
+        waitingConsumers.fetch_sub(1);
+        smutex_unlock(&mutex);
+        if (!popped)
+            return Task{ NULL, NULL };
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (waitingProducers.load(memory_order_relaxed) > 0) {
+        smutex_lock(&mutex);
+        scond_signal(&notFull, &mutex);
+        smutex_unlock(&mutex);
+    }
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ringWakeConsumers --
+ *
+ *      Called after n tasks were pushed onto the ring: wake up to n
+ *      sleeping consumers. See ringEnqueue for why the fence is
+ *      needed.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+ringWakeConsumers(int n)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (waitingConsumers.load(memory_order_relaxed) > 0) {
+        smutex_lock(&mutex);
+        wakeConsumers(n);
+        smutex_unlock(&mutex);
+    }
 }
 
+/*
+ * ------------------------------------------------------------------
+ * wakeConsumers --
+ *
+ *      Called with the mutex held after n tasks were added: signal
+ *      notEmpty once per task, but no more often than there are
+ *      consumers sleeping on it, rather than waking every sleeper
+ *      to find most of them too late for a task.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+wakeConsumers(int n)
+{
+    int wakeups = min(n, waitingConsumers.load(memory_order_relaxed));
+    for (int i = 0; i < wakeups; i++)
+        scond_signal(&notEmpty, &mutex);
+}
@@ -1,15 +1,55 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <queue>
 
 #include "sthread.h"
 
 typedef void (*handler_t) (void *); 
 
+/*
+ * issuedNs is the sthread_time_ns at which a generator issued the
+ * task, so that workers can tell queueing delay from service time;
+ * 0 if the task was not stamped.
+ *
+ * affinity is a key, such as the item id of a request, that tasks
+ * touching the same data share; a ShardedTaskQueue may use it to
+ * pick the task's shard. Tasks without one leave it 0.
+ */
 struct Task {
     handler_t handler;
     void* arg;
+    long long issuedNs = 0;
+    uint64_t affinity = 0;
+};
+
+enum TaskQueueKind {
+    MONITOR_QUEUE = 0,
+    RING_QUEUE
 };
 
+/*
+ * ------------------------------------------------------------------
+ * TaskSink --
+ * 
+ *      Something request generators can hand tasks to: a TaskQueue
+ *      or a WorkStealingPool.
+ *
+ * ------------------------------------------------------------------
+ */
+class TaskSink {
+    public:
+    virtual ~TaskSink() { }
+
+    virtual void enqueue(Task task) = 0;
+    virtual void enqueueBatch(const Task* batch, int n) = 0;
+};
+
+#define DEFAULT_RING_CAPACITY 1024
+#define MAX_TASK_BATCH        64
+
 /*
  * ------------------------------------------------------------------
  * TaskQueue --
@@ -17,14 +57,60 @@ struct Task {
  *      A thread-safe task queue. This queue should be implemented
  *      as a monitor.
  *
+ *      A MONITOR_QUEUE is an unbounded std::queue protected by the
+ *      queue mutex. Its consumers count themselves in
+ *      waitingConsumers while they sleep, so that a batch wakes only
+ *      as many of them as it has tasks.
+ *
+ *      A RING_QUEUE is a bounded lock-free multi-producer,
+ *      multi-consumer ring of ringCapacity slots (rounded up to a
+ *      power of two). Producers and consumers claim slots with a
+ *      compare-and-swap on tail and head and only fall back to the
+ *      queue mutex to sleep: consumers when the ring is empty,
+ *      producers when it is full. The waitingConsumers and
+ *      waitingProducers counts let the other side skip the mutex
+ *      when nobody sleeps.
+ *
+ *      Both kinds block in dequeue until a task is available or
+ *      the queue is closed.
+ *
+ *      close() drains the queue: tasks already queued are still
+ *      handed out, but once the queue is empty every blocked and
+ *      later dequeue returns at once with no task, so that the
+ *      consumers can exit after finishing the tasks they hold.
+ *      Nothing may be enqueued after close().
+ *
+ *      enqueueBatch and dequeueUpTo move several tasks per call so
+ *      that the cost of the mutex, or of the head and tail cache
+ *      lines, is paid once per batch rather than once per task.
+ *
  * ------------------------------------------------------------------
  */
-class TaskQueue {
+class TaskQueue : public TaskSink {
     private:
-    // TODO: More needed here.
+    struct RingCell {
+        std::atomic<size_t> seq;
+        Task task;
+    };
+
+    const TaskQueueKind kind;
+
+    std::queue<Task> tasks;
+    smutex_t mutex;
+    scond_t notEmpty;
+    scond_t notFull;
+
+    RingCell* ring;
+    size_t ringMask;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<int> waitingConsumers;
+    std::atomic<int> waitingProducers;
+    std::atomic<bool> closed;
 
     public:
-    TaskQueue();
+    explicit TaskQueue(TaskQueueKind queueKind = MONITOR_QUEUE,
+                       size_t ringCapacity = DEFAULT_RING_CAPACITY);
     ~TaskQueue();
     
     // no default copy constructor and assignment operators. this will prevent some
@@ -32,11 +118,27 @@ class TaskQueue {
     TaskQueue(const TaskQueue&) = delete;
     TaskQueue& operator=(const TaskQueue &) = delete;
 
-    void enqueue(Task task);
+    void enqueue(Task task) override;
     Task dequeue();
 
+    void enqueueBatch(const Task* batch, int n) override;
+    int dequeueUpTo(Task* batch, int max);
+    int tryDequeueUpTo(Task* batch, int max);
+
+    int close();
+    int pending();
+    bool isClosed() const { return closed.load(); }
+
+    void setProfileName(const char* name);
+
     private:
     int size();
     bool empty();
-};
 
+    bool ringTryPush(const Task& task);
+    bool ringTryPop(Task* task);
+    void ringEnqueue(Task task);
+    Task ringDequeue();
+    void ringWakeConsumers(int n);
+    void wakeConsumers(int n);
+};
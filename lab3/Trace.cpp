@@ -0,0 +1,512 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "RequestHandlers.h"
+#include "RequestPool.h"
+#include "Trace.h"
+
+using namespace std;
+
+/*
+ * ------------------------------------------------------------------
+ * encode --
+ *
+ *      Fill record with the request type and payload of task.
+ *
+ * Results:
+ *      False if task is not a request that can be traced.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+encode(const Task& task, TraceRecord* record)
+{
+    memset(record, 0, sizeof(*record));
+    int type = request_type(task.handler);
+    record->type = type;
+
+    switch (type) {
+        case ADD_ITEM:
+        {
+            auto req = static_cast<AddItemReq*>(task.arg);
+            record->items[0] = req->item_id;
+            record->quantity = req->quantity;
+            record->value[0] = req->price;
+            record->value[1] = req->discount;
+            return true;
+        }
+        case REMOVE_ITEM:
+        {
+            auto req = static_cast<RemoveItemReq*>(task.arg);
+            record->items[0] = req->item_id;
+            return true;
+        }
+        case ADD_STOCK:
+        {
+            auto req = static_cast<AddStockReq*>(task.arg);
+            record->items[0] = req->item_id;
+            record->quantity = req->additional_stock;
+            return true;
+        }
+        case CHANGE_ITEM_PRICE:
+        {
+            auto req = static_cast<ChangeItemPriceReq*>(task.arg);
+            record->items[0] = req->item_id;
+            record->value[0] = req->new_price;
+            return true;
+        }
+        case CHANGE_ITEM_DISCOUNT:
+        {
+            auto req = static_cast<ChangeItemDiscountReq*>(task.arg);
+            record->items[0] = req->item_id;
+            record->value[0] = req->new_discount;
+            return true;
+        }
+        case SET_SHIPPING_COST:
+        {
+            auto req = static_cast<SetShippingCostReq*>(task.arg);
+            record->value[0] = req->new_cost;
+            return true;
+        }
+        case SET_STORE_DISCOUNT:
+        {
+            auto req = static_cast<SetStoreDiscountReq*>(task.arg);
+            record->value[0] = req->new_discount;
+            return true;
+        }
+        case BUY_ITEM:
+        {
+            auto req = static_cast<BuyItemReq*>(task.arg);
+            record->items[0] = req->item_id;
+            record->value[0] = req->budget;
+            return true;
+        }
+        case BUY_MANY_ITEMS:
+        {
+            auto req = static_cast<BuyManyItemsReq*>(task.arg);
+            record->numItems = req->num_items;
+            for (int i = 0; i < req->num_items; i++)
+                record->items[i] = req->item_ids[i];
+            record->value[0] = req->budget;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+TraceWriter::
+TraceWriter() : file(NULL), startNs(0), records(0), failed(false)
+{
+    smutex_init(&mutex);
+}
+
+TraceWriter::
+~TraceWriter()
+{
+    if (file)
+        fclose(file);
+    smutex_destroy(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * open --
+ *
+ *      Create the trace file path and write its header, and start
+ *      the clock as start does. fineMode tells whether the store
+ *      the requests are generated for is in fine mode.
+ *
+ * Results:
+ *      False if the file could not be created or written; errno
+ *      tells why.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TraceWriter::
+open(const char* path, bool fineMode)
+{
+    assert(file == NULL);
+
+    file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.flags   = fineMode ? TRACE_FINE_MODE : 0;
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        failed = true;
+    startNs = sthread_time_ns();
+    return !failed;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * start --
+ *
+ *      Restart the clock that the issue times of the records are
+ *      relative to. Call it before any generator records.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TraceWriter::
+start()
+{
+    startNs = sthread_time_ns();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * record --
+ *
+ *      Append the n tasks of batch, issued by the generator of
+ *      stream. Tasks that are not requests are skipped.
+ *
+ * Results:
+ *      None. A failed write is reported by close.
+ *
+ * ------------------------------------------------------------------
+ */
+void TraceWriter::
+record(TraceStream stream, const Task* batch, int n)
+{
+    TraceRecord encoded[MAX_TASK_BATCH];
+
+    while (n > 0) {
+        int count = 0;
+        int taken = min(n, MAX_TASK_BATCH);
+        for (int i = 0; i < taken; i++) {
+            TraceRecord* record = &encoded[count];
+            if (!encode(batch[i], record))
+                continue;
+            record->stream   = stream;
+            record->issuedNs = batch[i].issuedNs ? batch[i].issuedNs - startNs
+                                                 : 0;
+            count++;
+        }
+
+        smutex_lock(&mutex);
+        if (fwrite(encoded, sizeof(TraceRecord), count, file) != (size_t) count)
+            failed = true;
+        records += count;
+        smutex_unlock(&mutex);
+
+        batch += taken;
+        n -= taken;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * recordFill --
+ *
+ *      Append an item added directly to the store before the run.
+ *
+ * Results:
+ *      None. A failed write is reported by close.
+ *
+ * ------------------------------------------------------------------
+ */
+void TraceWriter::
+recordFill(ItemId item_id, int quantity, double price, double discount)
+{
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.stream   = FILL_STREAM;
+    record.type     = ADD_ITEM;
+    record.items[0] = item_id;
+    record.quantity = quantity;
+    record.value[0] = price;
+    record.value[1] = discount;
+
+    smutex_lock(&mutex);
+    if (fwrite(&record, sizeof(record), 1, file) != 1)
+        failed = true;
+    records++;
+    smutex_unlock(&mutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * close --
+ *
+ *      Flush and close the trace file. No generator may still be
+ *      recording.
+ *
+ * Results:
+ *      False if any write to the file failed.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TraceWriter::
+close()
+{
+    if (file == NULL)
+        return !failed;
+    if (fclose(file) != 0)
+        failed = true;
+    file = NULL;
+    return !failed;
+}
+
+TraceReplayer::
+TraceReplayer() : fineMode(false), maxSpeed(false), startNs(0)
+{ }
+
+/*
+ * ------------------------------------------------------------------
+ * load --
+ *
+ *      Read the trace file path and sort its records by stream,
+ *      keeping their order within each stream.
+ *
+ * Results:
+ *      False if the file cannot be read or is not a valid trace.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TraceReplayer::
+load(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    TraceHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+                 memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == TRACE_VERSION;
+    fineMode = valid && (header.flags & TRACE_FINE_MODE);
+
+    TraceRecord record;
+    size_t got;
+    while (valid && (got = fread(&record, 1, sizeof(record), file)) > 0) {
+        if (got != sizeof(record) || record.stream >= NUM_TRACE_STREAMS ||
+            record.type >= NUM_REQUEST_TYPES || record.type == UPDATE_ITEM ||
+            record.numItems > MAX_BUY_ITEM) {
+            valid = false;
+            break;
+        }
+        records[record.stream].push_back(record);
+    }
+    if (ferror(file))
+        valid = false;
+    fclose(file);
+    return valid;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * start --
+ *
+ *      Start the replay clock. Call it once, before any stream is
+ *      replayed.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TraceReplayer::
+start()
+{
+    startNs = sthread_time_ns();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * fillStore --
+ *
+ *      Add the items of the fill stream to store directly, as
+ *      SupplierRequestGenerator::fillStore did when the trace was
+ *      recorded.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TraceReplayer::
+fillStore(EStore* store)
+{
+    for (const TraceRecord& record : records[FILL_STREAM])
+        store->addItem(record.items[0], record.quantity, record.value[0],
+                       record.value[1]);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * toTask --
+ *
+ *      Rebuild the request of record for store.
+ *
+ * Results:
+ *      The Task, with its affinity set as the generators set it.
+ *
+ * ------------------------------------------------------------------
+ */
+Task TraceReplayer::
+toTask(const TraceRecord& record, EStore* store)
+{
+    Task task;
+    task.affinity = record.items[0];
+
+    switch (record.type) {
+        case ADD_ITEM:
+        {
+            auto req = new_request<AddItemReq>();
+            req->store    = store;
+            req->item_id  = record.items[0];
+            req->quantity = record.quantity;
+            req->price    = record.value[0];
+            req->discount = record.value[1];
+
+            task.handler = add_item_handler;
+            task.arg     = req;
+            break;
+        }
+        case REMOVE_ITEM:
+        {
+            auto req = new_request<RemoveItemReq>();
+            req->store   = store;
+            req->item_id = record.items[0];
+
+            task.handler = remove_item_handler;
+            task.arg     = req;
+            break;
+        }
+        case ADD_STOCK:
+        {
+            auto req = new_request<AddStockReq>();
+            req->store            = store;
+            req->item_id          = record.items[0];
+            req->additional_stock = record.quantity;
+
+            task.handler = add_stock_handler;
+            task.arg     = req;
+            break;
+        }
+        case CHANGE_ITEM_PRICE:
+        {
+            auto req = new_request<ChangeItemPriceReq>();
+            req->store     = store;
+            req->item_id   = record.items[0];
+            req->new_price = record.value[0];
+
+            task.handler = change_item_price_handler;
+            task.arg     = req;
+            break;
+        }
+        case CHANGE_ITEM_DISCOUNT:
+        {
+            auto req = new_request<ChangeItemDiscountReq>();
+            req->store        = store;
+            req->item_id      = record.items[0];
+            req->new_discount = record.value[0];
+
+            task.handler = change_item_discount_handler;
+            task.arg     = req;
+            break;
+        }
+        case SET_SHIPPING_COST:
+        {
+            auto req = new_request<SetShippingCostReq>();
+            req->store    = store;
+            req->new_cost = record.value[0];
+
+            task.handler = set_shipping_cost_handler;
+            task.arg     = req;
+            break;
+        }
+        case SET_STORE_DISCOUNT:
+        {
+            auto req = new_request<SetStoreDiscountReq>();
+            req->store        = store;
+            req->new_discount = record.value[0];
+
+            task.handler = set_store_discount_handler;
+            task.arg     = req;
+            break;
+        }
+        case BUY_ITEM:
+        {
+            auto req = new_request<BuyItemReq>();
+            req->store   = store;
+            req->item_id = record.items[0];
+            req->budget  = record.value[0];
+
+            task.handler = buy_item_handler;
+            task.arg     = req;
+            break;
+        }
+        case BUY_MANY_ITEMS:
+        {
+            auto req = new_request<BuyManyItemsReq>();
+            req->store     = store;
+            req->num_items = record.numItems;
+            for (int i = 0; i < record.numItems; i++)
+                req->item_ids[i] = record.items[i];
+            req->budget = record.value[0];
+
+            task.handler = buy_many_items_handler;
+            task.arg     = req;
+            break;
+        }
+        default:
+            assert(false);
+    }
+    return task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueTasks --
+ *
+ *      Issue every request of stream to sink for store, at the
+ *      original or at maximum speed, stamping each task with the
+ *      time it was issued.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TraceReplayer::
+enqueueTasks(TraceStream stream, TaskSink* sink, EStore* store, int batchSize)
+{
+    assert(stream != FILL_STREAM);
+    assert(batchSize >= 1 && batchSize <= MAX_TASK_BATCH);
+
+    const vector<TraceRecord>& trace = records[stream];
+    Task batch[MAX_TASK_BATCH];
+    size_t next = 0;
+
+    while (next < trace.size()) {
+        if (!maxSpeed) {
+            long long wait = startNs + trace[next].issuedNs - sthread_time_ns();
+            if (wait > 0)
+                sthread_sleep(wait / 1000000000, wait % 1000000000);
+        }
+
+        long long issued = sthread_time_ns();
+        int n = 0;
+        while (n < batchSize && next < trace.size() &&
+               (maxSpeed || startNs + trace[next].issuedNs <= issued)) {
+            batch[n] = toTask(trace[next++], store);
+            batch[n].issuedNs = issued;
+            n++;
+        }
+
+        if (n == 1)
+            sink->enqueue(batch[0]);
+        else
+            sink->enqueueBatch(batch, n);
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "EStore.h"
+#include "Request.h"
+#include "sthread.h"
+#include "TaskQueue.h"
+
+/*
+ * A trace file starts with a TraceHeader and is followed by
+ * TraceRecords, both written in the byte order of the machine that
+ * recorded them. TRACE_FINE_MODE is set in flags if the customer
+ * requests were generated for a store in fine mode, since the
+ * customer requests of the two modes differ.
+ */
+#define TRACE_MAGIC     "ESTRACE\n"
+#define TRACE_VERSION   1
+#define TRACE_FINE_MODE 0x1
+
+/*
+ * Which generator issued a traced request. FILL_STREAM holds the
+ * items added by SupplierRequestGenerator::fillStore before the run.
+ */
+enum TraceStream {
+    SUPPLIER_STREAM = 0,
+    CUSTOMER_STREAM,
+    FILL_STREAM,
+    NUM_TRACE_STREAMS
+};
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+};
+
+/*
+ * One request. issuedNs is the time it was issued, relative to the
+ * start of the recording, and type its request type (see
+ * Request.h). The payload fields hold, depending on the type:
+ *
+ *      ADD_ITEM              items[0], quantity, value[0] price,
+ *                            value[1] discount
+ *      REMOVE_ITEM           items[0]
+ *      ADD_STOCK             items[0], quantity
+ *      CHANGE_ITEM_PRICE     items[0], value[0] price
+ *      CHANGE_ITEM_DISCOUNT  items[0], value[0] discount
+ *      SET_SHIPPING_COST     value[0] cost
+ *      SET_STORE_DISCOUNT    value[0] discount
+ *      BUY_ITEM              items[0], value[0] budget
+ *      BUY_MANY_ITEMS        items[0 .. numItems), value[0] budget
+ *
+ * and are 0 otherwise.
+ */
+struct TraceRecord {
+    int64_t issuedNs;
+    uint8_t stream;
+    uint8_t type;
+    uint16_t numItems;
+    int32_t quantity;
+    uint64_t items[MAX_BUY_ITEM];
+    double value[2];
+};
+
+static_assert(sizeof(TraceRecord) == 96, "trace record layout changed");
+
+/*
+ * ------------------------------------------------------------------
+ * TraceWriter --
+ *
+ *      Records the requests generators issue to a trace file, with
+ *      the times they were issued relative to the call to start.
+ *      Any number of generator threads may share one writer;
+ *      records are appended in the order the generators hand them
+ *      over.
+ *      Tasks must be recorded before they are enqueued, since a
+ *      worker frees a request once it has run.
+ *
+ * ------------------------------------------------------------------
+ */
+class TraceWriter {
+    private:
+    FILE* file;
+    smutex_t mutex;
+    long long startNs;
+    long records;
+    bool failed;
+
+    public:
+    TraceWriter();
+    ~TraceWriter();
+
+    // no default copy constructor and assignment operators. this will prevent some
+    // painful bugs by converting them into compiler errors.
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter &) = delete;
+
+    bool open(const char* path, bool fineMode);
+    void start();
+    void record(TraceStream stream, const Task* batch, int n);
+    void recordFill(ItemId item_id, int quantity, double price,
+                    double discount);
+    bool close();
+
+    long recordCount() const { return records; }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * TraceReplayer --
+ *
+ *      Loads a trace file and issues its requests again, each
+ *      stream to the TaskSink of its own generator thread.
+ *
+ *      At the original speed every request is issued when it was
+ *      issued in the recording, relative to the call to start, on
+ *      the absolute schedule RequestGenerator::enqueueTasks keeps.
+ *      At maximum speed requests are issued back to back. Either
+ *      way, consecutive requests of a stream that are already due
+ *      are issued with one enqueueBatch call of up to batchSize.
+ *
+ *      Replaying one stream belongs to one thread; different
+ *      streams may be replayed concurrently.
+ *
+ * ------------------------------------------------------------------
+ */
+class TraceReplayer {
+    private:
+    std::vector<TraceRecord> records[NUM_TRACE_STREAMS];
+    bool fineMode;
+    bool maxSpeed;
+    long long startNs;
+
+    static Task toTask(const TraceRecord& record, EStore* store);
+
+    public:
+    TraceReplayer();
+
+    bool load(const char* path);
+    void setMaxSpeed(bool enable) { maxSpeed = enable; }
+    bool recordedInFineMode() const { return fineMode; }
+    int count(TraceStream stream) const { return records[stream].size(); }
+
+    void start();
+    void fillStore(EStore* store);
+    void enqueueTasks(TraceStream stream, TaskSink* sink, EStore* store,
+                      int batchSize);
+};
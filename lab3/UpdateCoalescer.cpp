@@ -0,0 +1,168 @@
+#include <cassert>
+
+#include "RequestHandlers.h"
+#include "RequestPool.h"
+#include "UpdateCoalescer.h"
+
+
+UpdateCoalescer::
+UpdateCoalescer() : merged(0)
+{ }
+
+/*
+ * ------------------------------------------------------------------
+ * absorb --
+ *
+ *      Fold the add stock, item price or item discount request of
+ *      task into update, as if it ran after update, and free it.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void UpdateCoalescer::
+absorb(UpdateItemReq* update, const Task& task)
+{
+    if (task.handler == add_stock_handler) {
+        auto req = static_cast<AddStockReq*>(task.arg);
+        update->store             = req->store;
+        update->item_id           = req->item_id;
+        update->additional_stock += req->additional_stock;
+        delete_request(req);
+    } else if (task.handler == change_item_price_handler) {
+        auto req = static_cast<ChangeItemPriceReq*>(task.arg);
+        update->store     = req->store;
+        update->item_id   = req->item_id;
+        update->set_price = true;
+        update->new_price = req->new_price;
+        delete_request(req);
+    } else {
+        assert(task.handler == change_item_discount_handler);
+        auto req = static_cast<ChangeItemDiscountReq*>(task.arg);
+        update->store        = req->store;
+        update->item_id      = req->item_id;
+        update->set_discount = true;
+        update->new_discount = req->new_discount;
+        delete_request(req);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * toUpdate --
+ *
+ *      Turn task, an add stock, item price or item discount
+ *      request, into an update item request with the same effect.
+ *      A task that already is one is left alone.
+ *
+ * Results:
+ *      The update item request, now task's argument.
+ *
+ * ------------------------------------------------------------------
+ */
+UpdateItemReq* UpdateCoalescer::
+toUpdate(Task* task)
+{
+    if (task->handler == update_item_handler)
+        return static_cast<UpdateItemReq*>(task->arg);
+
+    auto update = new_request<UpdateItemReq>();
+    update->additional_stock = 0;
+    update->set_price        = false;
+    update->set_discount     = false;
+    update->new_price        = 0;
+    update->new_discount     = 0;
+    absorb(update, *task);
+
+    task->handler = update_item_handler;
+    task->arg     = update;
+    return update;
+}
+
+/*
+ * Return the item a supplier request is about, if it is about one.
+ */
+static bool
+item_of(const Task& task, int type, ItemId* item_id)
+{
+    switch (type) {
+        case ADD_ITEM:
+            *item_id = static_cast<AddItemReq*>(task.arg)->item_id;
+            return true;
+        case REMOVE_ITEM:
+            *item_id = static_cast<RemoveItemReq*>(task.arg)->item_id;
+            return true;
+        case ADD_STOCK:
+            *item_id = static_cast<AddStockReq*>(task.arg)->item_id;
+            return true;
+        case CHANGE_ITEM_PRICE:
+            *item_id = static_cast<ChangeItemPriceReq*>(task.arg)->item_id;
+            return true;
+        case CHANGE_ITEM_DISCOUNT:
+            *item_id = static_cast<ChangeItemDiscountReq*>(task.arg)->item_id;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * coalesce --
+ *
+ *      Merge the updates of each item in the n tasks of batch, in
+ *      place. The tasks that remain keep their order. A merged task
+ *      keeps the issue time of its first update.
+ *
+ * Results:
+ *      The number of tasks left in batch.
+ *
+ * ------------------------------------------------------------------
+ */
+int UpdateCoalescer::
+coalesce(Task* batch, int n)
+{
+    // The items with a run of updates that later updates may join,
+    // and where in batch that run is.
+    struct Run {
+        ItemId item_id;
+        int index;
+    };
+    Run runs[MAX_TASK_BATCH];
+    int numRuns = 0;
+
+    assert(n <= MAX_TASK_BATCH);
+
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        Task task = batch[i];
+        int type = request_type(task.handler);
+        ItemId item_id;
+        if (!item_of(task, type, &item_id)) {
+            batch[kept++] = task;
+            continue;
+        }
+
+        Run* run = runs;
+        while (run < runs + numRuns && run->item_id != item_id)
+            run++;
+
+        if (type == ADD_ITEM || type == REMOVE_ITEM) {
+            if (run < runs + numRuns)
+                *run = runs[--numRuns];
+            batch[kept++] = task;
+            continue;
+        }
+
+        if (run == runs + numRuns) {
+            runs[numRuns++] = Run{item_id, kept};
+            batch[kept++] = task;
+            continue;
+        }
+
+        absorb(toUpdate(&batch[run->index]), task);
+        merged++;
+    }
+    return kept;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "Request.h"
+#include "TaskQueue.h"
+
+/*
+ * ------------------------------------------------------------------
+ * UpdateCoalescer --
+ *
+ *      Merges the supplier updates of a batch of tasks that concern
+ *      the same item, so that a supplier thread takes the item's
+ *      lock and looks at its waiters once per batch instead of once
+ *      per update.
+ *
+ *      The add stock, item price and item discount requests of one
+ *      item become a single UpdateItemReq that adds up the stock and
+ *      keeps the last price and the last discount. It runs where
+ *      the first of them was. An add item or remove item request of
+ *      the item ends the run: later updates start a new one after
+ *      it. Every other task is kept as it is and in order.
+ *
+ *      The store ends up as if the batch had run one task at a
+ *      time, since updates of different items, and the store-wide
+ *      shipping cost and discount, do not affect each other's
+ *      fields. Only the waiters that intermediate states would have
+ *      woken are not woken.
+ *
+ *      A coalescer belongs to one thread.
+ *
+ * ------------------------------------------------------------------
+ */
+class UpdateCoalescer {
+    private:
+    long merged;
+
+    static void absorb(UpdateItemReq* update, const Task& task);
+    static UpdateItemReq* toUpdate(Task* task);
+
+    public:
+    UpdateCoalescer();
+
+    int coalesce(Task* batch, int n);
+
+    long mergedUpdates() const { return merged; }
+};
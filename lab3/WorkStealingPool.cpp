@@ -0,0 +1,451 @@
+#include <cassert>
+#include <cstdlib>
+
+#include "WorkStealingPool.h"
+
+using namespace std;
+
+thread_local WorkStealingPool::Worker* WorkStealingPool::currentWorker = NULL;
+
+WorkStealingPool::
+WorkStealingPool(int numWorkers, int numPriorityWorkers,
+                 int (*taskTypeOf)(handler_t), int numTaskTypes)
+    : sinks{Sink(this, PRIORITY_TASK), Sink(this, NORMAL_TASK)},
+      nextWorker(0), sleepers(0), prioritySleepers(0),
+      typeOf(taskTypeOf), numTypes(taskTypeOf ? numTaskTypes : 0),
+      stopping(false)
+{
+    assert(numWorkers > 0);
+    assert(numPriorityWorkers >= 0 && numPriorityWorkers < numWorkers);
+
+    for (int c = 0; c < NUM_TASK_CLASSES; c++) {
+        queued[c].store(0);
+        unfinished[c].store(0);
+    }
+    smutex_init(&idleMutex);
+    scond_init(&workAvailable);
+    scond_init(&priorityAvailable);
+    scond_init(&classDone);
+    sthread_profile_name(&idleMutex, "WorkStealingPool::idleMutex");
+    sthread_profile_name(&workAvailable, "WorkStealingPool::workAvailable");
+    sthread_profile_name(&priorityAvailable,
+                         "WorkStealingPool::priorityAvailable");
+    sthread_profile_name(&classDone, "WorkStealingPool::classDone");
+
+    for (int i = 0; i < numWorkers; i++) {
+        Worker* w = new Worker();
+        w->pool  = this;
+        w->index = i;
+        w->priorityOnly = i < numPriorityWorkers;
+        w->seed  = 2 * i + 1;
+        w->queueDelay.resize(numTypes);
+        w->service.resize(numTypes);
+        smutex_init(&w->mutex);
+        sthread_profile_name(&w->mutex, "WorkStealingPool::Worker");
+        workers.push_back(w);
+    }
+    for (Worker* w : workers)
+        sthread_create(&w->thread, workerMain, w);
+}
+
+WorkStealingPool::
+~WorkStealingPool()
+{
+    shutdown();
+
+    for (Worker* w : workers) {
+        smutex_destroy(&w->mutex);
+        delete w;
+    }
+    scond_destroy(&classDone);
+    scond_destroy(&priorityAvailable);
+    scond_destroy(&workAvailable);
+    smutex_destroy(&idleMutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * submit --
+ *
+ *      Queue the task to run on one of the workers.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkStealingPool::
+submit(Task task, TaskClass c)
+{
+    submitBatch(&task, 1, c);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * submitBatch --
+ *
+ *      Queue the n tasks of batch. They all go to the same worker
+ *      deque, from where idle workers steal them.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkStealingPool::
+submitBatch(const Task* batch, int n, TaskClass c)
+{
+    if (n <= 0)
+        return;
+
+    Worker* w = currentWorker;
+    if (w == NULL || w->pool != this)
+        w = workers[nextWorker.fetch_add(1, memory_order_relaxed) %
+                    workers.size()];
+
+    unfinished[c].fetch_add(n);
+    queued[c].fetch_add(n);
+
+    smutex_lock(&w->mutex);
+    for (int i = 0; i < n; i++)
+        w->tasks[c].push_back(batch[i]);
+    smutex_unlock(&w->mutex);
+
+    wakeWorkers(n, c);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * waitForIdle --
+ *
+ *      Block until every task of class c submitted so far has
+ *      finished running.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkStealingPool::
+waitForIdle(TaskClass c)
+{
+    smutex_lock(&idleMutex);
+    while (unfinished[c].load() > 0)
+        scond_wait(&classDone, &idleMutex);
+    smutex_unlock(&idleMutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * shutdown --
+ *
+ *      Let the workers run every queued task, then stop them and
+ *      wait for them to exit. Calling it again does nothing.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkStealingPool::
+shutdown()
+{
+    smutex_lock(&idleMutex);
+    bool wasStopping = stopping;
+    stopping = true;
+    scond_broadcast(&workAvailable, &idleMutex);
+    scond_broadcast(&priorityAvailable, &idleMutex);
+    smutex_unlock(&idleMutex);
+
+    if (wasStopping)
+        return;
+    for (Worker* w : workers)
+        sthread_join(w->thread);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeWorkers --
+ *
+ *      Wake sleeping workers to run n newly queued tasks of class c.
+ *      queued was raised before the tasks were pushed, and a worker
+ *      announces itself in sleepers before it re-checks queued under
+ *      idleMutex, so either it sees the new tasks or we see it and
+ *      signal it. Reserved workers sleep on their own condition so
+ *      that normal tasks never wake them; priority tasks wake both
+ *      kinds, since the others may all be busy.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkStealingPool::
+wakeWorkers(int n, TaskClass c)
+{
+    bool wakePriority = c == PRIORITY_TASK && prioritySleepers.load() > 0;
+    if (sleepers.load() == 0 && !wakePriority)
+        return;
+
+    smutex_lock(&idleMutex);
+    if (n == 1) {
+        scond_signal(&workAvailable, &idleMutex);
+        if (wakePriority)
+            scond_signal(&priorityAvailable, &idleMutex);
+    } else {
+        scond_broadcast(&workAvailable, &idleMutex);
+        if (wakePriority)
+            scond_broadcast(&priorityAvailable, &idleMutex);
+    }
+    smutex_unlock(&idleMutex);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * taskFinished --
+ *
+ *      Account for a finished task of class c and wake waitForIdle
+ *      callers when it was the last one.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkStealingPool::
+taskFinished(TaskClass c)
+{
+    stats.executed.fetch_add(1, memory_order_relaxed);
+    if (unfinished[c].fetch_sub(1) == 1) {
+        smutex_lock(&idleMutex);
+        scond_broadcast(&classDone, &idleMutex);
+        smutex_unlock(&idleMutex);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * recordTask --
+ *
+ *      Record the queueing delay and handler time of task, which w
+ *      started running at startNs, under its type. Tasks of no type
+ *      are not recorded; for tasks without an issue time only the
+ *      handler time is.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkStealingPool::
+recordTask(Worker* w, const Task& task, long long startNs)
+{
+    int type = typeOf(task.handler);
+    if (type < 0 || type >= numTypes)
+        return;
+    if (task.issuedNs != 0)
+        w->queueDelay[type].record(startNs - task.issuedNs);
+    w->service[type].record(sthread_time_ns() - startNs);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * mergeLatencies --
+ *
+ *      Add the latencies every worker recorded to queueDelay and
+ *      service, arrays of numTypes recorders. Only valid once the
+ *      pool has shut down.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkStealingPool::
+mergeLatencies(LatencyRecorder* queueDelay, LatencyRecorder* service) const
+{
+    assert(stopping);
+
+    for (const Worker* w : workers) {
+        for (int t = 0; t < numTypes; t++) {
+            queueDelay[t].merge(w->queueDelay[t]);
+            service[t].merge(w->service[t]);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * popLocal --
+ *
+ *      Take the newest task of class c from w's own deque.
+ *
+ * Results:
+ *      True and the task in *task, or false if the deque is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkStealingPool::
+popLocal(Worker* w, TaskClass c, Task* task)
+{
+    bool found = false;
+
+    smutex_lock(&w->mutex);
+    if (!w->tasks[c].empty()) {
+        *task = w->tasks[c].back();
+        w->tasks[c].pop_back();
+        found = true;
+    }
+    smutex_unlock(&w->mutex);
+    return found;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * steal --
+ *
+ *      Take the oldest task of class c from another worker. Victims
+ *      are visited starting at a random one so that thieves spread
+ *      out instead of all hitting the same deque.
+ *
+ * Results:
+ *      True and the task in *task, or false if no other worker has
+ *      a task of class c.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkStealingPool::
+steal(Worker* thief, TaskClass c, Task* task)
+{
+    int n = workers.size();
+    int start = rand_r(&thief->seed) % n;
+
+    for (int i = 0; i < n; i++) {
+        Worker* victim = workers[(start + i) % n];
+        if (victim == thief)
+            continue;
+
+        bool found = false;
+        smutex_lock(&victim->mutex);
+        if (!victim->tasks[c].empty()) {
+            *task = victim->tasks[c].front();
+            victim->tasks[c].pop_front();
+            found = true;
+        }
+        smutex_unlock(&victim->mutex);
+
+        if (found) {
+            stats.steals.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+    }
+    stats.failedSteals.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * hasWork --
+ *
+ *      Check whether a task that w may run is queued anywhere.
+ *
+ * Results:
+ *      True if there is one.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkStealingPool::
+hasWork(const Worker* w) const
+{
+    return queued[PRIORITY_TASK].load() > 0 ||
+           (!w->priorityOnly && queued[NORMAL_TASK].load() > 0);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * findTask --
+ *
+ *      Find the next task for w to run: priority tasks, local then
+ *      stolen, before normal tasks, local then stolen. A reserved
+ *      worker only looks for priority tasks.
+ *
+ * Results:
+ *      True and the task and its class, or false if there is no
+ *      queued task w may run.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkStealingPool::
+findTask(Worker* w, Task* task, TaskClass* c)
+{
+    if (!hasWork(w))
+        return false;
+
+    int numClasses = w->priorityOnly ? PRIORITY_TASK + 1 : NUM_TASK_CLASSES;
+    for (int i = 0; i < numClasses; i++) {
+        TaskClass tc = (TaskClass) i;
+        if (popLocal(w, tc, task) || steal(w, tc, task)) {
+            queued[tc].fetch_sub(1);
+            *c = tc;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * workerMain --
+ *
+ *      The worker thread. Run tasks until the pool shuts down and
+ *      no task is left.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void* WorkStealingPool::
+workerMain(void* arg)
+{
+    Worker* w = static_cast<Worker*>(arg);
+    WorkStealingPool* pool = w->pool;
+    currentWorker = w;
+
+    while (true) {
+        Task task;
+        TaskClass c;
+
+        if (pool->findTask(w, &task, &c)) {
+            long long start = pool->typeOf ? sthread_time_ns() : 0;
+            task.handler(task.arg);
+            if (pool->typeOf)
+                pool->recordTask(w, task, start);
+            pool->taskFinished(c);
+            continue;
+        }
+
+        atomic<int>& sleepers = w->priorityOnly ? pool->prioritySleepers
+                                                : pool->sleepers;
+        scond_t* available = w->priorityOnly ? &pool->priorityAvailable
+                                             : &pool->workAvailable;
+
+        smutex_lock(&pool->idleMutex);
+        sleepers.fetch_add(1);
+        bool done = false;
+        while (!pool->hasWork(w)) {
+            if (pool->stopping) {
+                done = true;
+                break;
+            }
+            pool->stats.sleeps.fetch_add(1, memory_order_relaxed);
+            scond_wait(available, &pool->idleMutex);
+        }
+        sleepers.fetch_sub(1);
+        smutex_unlock(&pool->idleMutex);
+
+        if (done)
+            break;
+    }
+    return NULL;
+}
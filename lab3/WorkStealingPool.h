@@ -0,0 +1,156 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#include "LatencyRecorder.h"
+#include "sthread.h"
+#include "TaskQueue.h"
+
+/*
+ * Task classes of a WorkStealingPool. PRIORITY_TASK tasks are always
+ * run before NORMAL_TASK tasks.
+ */
+enum TaskClass {
+    PRIORITY_TASK = 0,
+    NORMAL_TASK,
+    NUM_TASK_CLASSES
+};
+
+/*
+ * ------------------------------------------------------------------
+ * PoolStats --
+ *
+ *      Counters describing how a WorkStealingPool ran its tasks.
+ *
+ * ------------------------------------------------------------------
+ */
+struct PoolStats {
+    std::atomic<long> executed;
+    std::atomic<long> steals;
+    std::atomic<long> failedSteals;
+    std::atomic<long> sleeps;
+
+    PoolStats() : executed(0), steals(0), failedSteals(0), sleeps(0) { }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * WorkStealingPool --
+ *
+ *      A fixed set of worker threads, each with its own deque of
+ *      tasks per TaskClass. A worker pops from the back of its own
+ *      deques and, when they are empty, steals from the front of
+ *      the deques of randomly chosen victims. It looks for
+ *      PRIORITY_TASK work everywhere before it takes a NORMAL_TASK.
+ *
+ *      Tasks submitted by a worker go to its own deque; tasks
+ *      submitted by other threads are spread round-robin.
+ *
+ *      A worker that finds no task anywhere sleeps on the pool's
+ *      idle mutex until a task is submitted or the pool shuts down.
+ *
+ *      The first numPriorityWorkers workers are reserved for
+ *      PRIORITY_TASK work: they never take a NORMAL_TASK, so priority
+ *      tasks keep running even while every other worker is busy.
+ *
+ *      Tasks must not block on other tasks: a worker blocked in a
+ *      task is lost to the pool until it returns, and once every
+ *      worker that could run the task it waits for is blocked, the
+ *      pool deadlocks. A task that may wait on priority tasks, such
+ *      as a purchase waiting for a supplier, needs at least one
+ *      reserved worker.
+ *
+ *      Tasks must not exit their thread, so stop_handler tasks are
+ *      not used with a pool; call shutdown() instead.
+ *
+ *      If the pool is given a typeOf function, mapping a handler to
+ *      one of numTypes task types or to -1, each worker records the
+ *      queueing delay, from issuedNs, and the handler time of the
+ *      tasks of each type it runs. mergeLatencies adds them up once
+ *      the pool has shut down.
+ *
+ * ------------------------------------------------------------------
+ */
+class WorkStealingPool {
+    private:
+    struct alignas(CACHE_LINE_SIZE) Worker {
+        WorkStealingPool* pool;
+        int index;
+        bool priorityOnly;
+        unsigned int seed;
+        sthread_t thread;
+
+        smutex_t mutex;
+        std::deque<Task> tasks[NUM_TASK_CLASSES];
+
+        std::vector<LatencyRecorder> queueDelay;
+        std::vector<LatencyRecorder> service;
+    };
+
+    class Sink : public TaskSink {
+        WorkStealingPool* pool;
+        TaskClass taskClass;
+
+        public:
+        Sink(WorkStealingPool* p, TaskClass c) : pool(p), taskClass(c) { }
+        void enqueue(Task task) override { pool->submit(task, taskClass); }
+        void enqueueBatch(const Task* batch, int n) override
+        {
+            pool->submitBatch(batch, n, taskClass);
+        }
+    };
+
+    std::vector<Worker*> workers;
+    Sink sinks[NUM_TASK_CLASSES];
+
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned int> nextWorker;
+    alignas(CACHE_LINE_SIZE) std::atomic<long> queued[NUM_TASK_CLASSES];
+    std::atomic<long> unfinished[NUM_TASK_CLASSES];
+    std::atomic<int> sleepers;
+    std::atomic<int> prioritySleepers;
+
+    int (*const typeOf)(handler_t handler);
+    const int numTypes;
+
+    smutex_t idleMutex;
+    scond_t workAvailable;
+    scond_t priorityAvailable;
+    scond_t classDone;
+    bool stopping;
+
+    PoolStats stats;
+
+    static void* workerMain(void* arg);
+    static thread_local Worker* currentWorker;
+
+    bool popLocal(Worker* w, TaskClass c, Task* task);
+    bool steal(Worker* thief, TaskClass c, Task* task);
+    bool hasWork(const Worker* w) const;
+    bool findTask(Worker* w, Task* task, TaskClass* c);
+    void wakeWorkers(int n, TaskClass c);
+    void taskFinished(TaskClass c);
+    void recordTask(Worker* w, const Task& task, long long startNs);
+
+    public:
+    explicit WorkStealingPool(int numWorkers, int numPriorityWorkers = 0,
+                              int (*taskTypeOf)(handler_t) = NULL,
+                              int numTaskTypes = 0);
+    ~WorkStealingPool();
+
+    // no default copy constructor and assignment operators. this will prevent some
+    // painful bugs by converting them into compiler errors.
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool &) = delete;
+
+    void submit(Task task, TaskClass c);
+    void submitBatch(const Task* batch, int n, TaskClass c);
+    void waitForIdle(TaskClass c);
+    void shutdown();
+    void mergeLatencies(LatencyRecorder* queueDelay,
+                        LatencyRecorder* service) const;
+
+    TaskSink* sink(TaskClass c) { return &sinks[c]; }
+    const PoolStats& getStats() const { return stats; }
+};
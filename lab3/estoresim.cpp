@@ -1,22 +1,256 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <iostream>
 
+#include "Autoscaler.h"
+#include "Benchmark.h"
+#include "Completion.h"
 #include "EStore.h"
+#include "LatencyRecorder.h"
+#include "LoadModel.h"
 #include "TaskQueue.h"
+#include "RequestGenerator.h"
+#include "RequestHandlers.h"
+#include "ShardedTaskQueue.h"
+#include "Trace.h"
+#include "UpdateCoalescer.h"
+#include "WorkStealingPool.h"
+
+using namespace std;
+
+/*
+ * Options selected on the command line.
+ *
+ * batchSize > 1 makes the generators enqueue and the workers dequeue
+ * up to batchSize tasks per TaskQueue call.
+ *
+ * workStealing replaces the supplier and customer threads and their
+ * queues with one WorkStealingPool of numSuppliers + numCustomers
+ * workers that runs both kinds of request, supplier requests first.
+ * Unless purchases run as coroutines, one of the workers only runs
+ * supplier requests, so that customers blocked in the store cannot
+ * take every worker from the suppliers that would release them.
+ *
+ * arrivals and arrivalRate set how each generator issues its
+ * maxTasks requests, and a zipfSkew above 0 makes item ids
+ * Zipf-distributed instead of uniform.
+ *
+ * numItems is the size of the catalog the requests draw from and the
+ * store is sized for; sparseIds scatters its ids over the 64-bit id
+ * space, and fillInventory adds every item before the run starts.
+ * layout is how the store lays out the hot fields of its items.
+ *
+ * coalesce makes supplier threads dequeue batches, of at least
+ * SIM_BATCH_SIZE tasks, and merge the updates of each item in a
+ * batch with an UpdateCoalescer. It does not apply to the
+ * work-stealing pool.
+ *
+ * customerShards > 0 replaces the customer queue with a
+ * ShardedTaskQueue of that many shards, spread by shardPolicy;
+ * customer thread i has shard i % customerShards as its home.
+ *
+ * autoscale lets an Autoscaler grow and shrink the supplier and the
+ * customer threads, each between minWorkers and maxWorkers, as the
+ * load changes. It does not apply to the work-stealing pool.
+ *
+ * record, if set, records every request the generators issue, and
+ * the items of fillInventory. replay, if set, issues the requests of
+ * a recorded trace instead of generating them, and fills the store
+ * with its items; maxTasks, the arrival options and fillInventory
+ * then do not apply.
+ *
+ * trackOutcomes attaches a Completion to every generated purchase
+ * and reports how many were bought and how long they took.
+ *
+ * coroutines runs purchases as coroutines (see EStore), so that an
+ * order waiting in the store suspends instead of blocking a customer
+ * thread. Woken purchases are resumed through the customer queue, or
+ * the pool, and since wakers must never block on it, the customer
+ * queue is then a monitor queue even with queueKind RING_QUEUE.
+ */
+struct SimOptions {
+    EStoreMode storeMode;
+    bool waitForOrders;
+    TaskQueueKind queueKind;
+    int batchSize;
+    bool workStealing;
+    int maxTasks;
+    ArrivalKind arrivals;
+    double arrivalRate;
+    double zipfSkew;
+    ItemId numItems;
+    bool sparseIds;
+    bool fillInventory;
+    InventoryLayout layout;
+    bool coalesce;
+    int customerShards;
+    ShardPolicy shardPolicy;
+    bool autoscale;
+    int minWorkers;
+    int maxWorkers;
+    TraceWriter* record;
+    TraceReplayer* replay;
+    bool trackOutcomes;
+    bool coroutines;
+
+    SimOptions()
+        : storeMode(COARSE_MODE), waitForOrders(false),
+          queueKind(MONITOR_QUEUE),
+          batchSize(1), workStealing(false), maxTasks(100),
+          arrivals(CONSTANT_ARRIVALS), arrivalRate(DEFAULT_ARRIVAL_RATE),
+          zipfSkew(0), numItems(INVENTORY_SIZE), sparseIds(false),
+          fillInventory(false), layout(PADDED_LAYOUT), coalesce(false),
+          customerShards(0), shardPolicy(ROUND_ROBIN_SHARDS),
+          autoscale(false), minWorkers(1), maxWorkers(1), record(NULL),
+          replay(NULL), trackOutcomes(false), coroutines(false) { }
+};
+
+#define SIM_BATCH_SIZE 16
+
+class Simulation;
+struct WorkerGroup;
+
+/*
+ * A supplier or customer thread and the queueing delay and service
+ * time of the requests it ran, by request type. coalescer is set if
+ * the thread merges the updates of its batches. A thread served by
+ * a sharded queue has shards set instead of queue, and home is its
+ * home shard. completed counts the tasks the thread ran, and retired
+ * is set once the thread has retired and is about to exit.
+ */
+struct Worker {
+    Simulation* sim;
+    WorkerGroup* group;
+    TaskQueue* queue;
+    ShardedTaskQueue* shards;
+    int home;
+    UpdateCoalescer* coalescer;
+    sthread_t thread;
+    std::atomic<long> completed;
+    std::atomic<bool> retired;
+
+    LatencyRecorder queueDelay[NUM_REQUEST_TYPES];
+    LatencyRecorder service[NUM_REQUEST_TYPES];
+};
+
+/*
+ * The supplier or the customer threads and the queue they serve.
+ *
+ * running counts the threads that have not retired and target is the
+ * number of threads the group should have. Without autoscaling the
+ * two stay equal. Otherwise a thread that finds more than target
+ * threads running when it goes for its next task retires, and a
+ * thread sleeping on an empty queue notices only once it is woken.
+ *
+ * workers holds the threads of the group that have not been joined
+ * yet: those still running and those that retired since the last
+ * rescale. Joined threads are freed, once their tasks, latencies and
+ * merged updates have been added to the group's own. started counts
+ * every thread the group started. They and closed are protected by
+ * mutex, so that no thread is started once the queue is closed.
+ */
+struct WorkerGroup {
+    Simulation* sim;
+    const char* name;
+    TaskQueue* queue;
+    ShardedTaskQueue* shards;
+    void* (*body)(void*);
+    bool coalesce;
+    int scalerGroup;
+
+    std::atomic<int> running;
+    std::atomic<int> target;
+
+    smutex_t mutex;
+    bool closed;
+    std::vector<Worker*> workers;
+    int started;
+    long completed;
+    long mergedUpdates;
+    LatencyRecorder queueDelay[NUM_REQUEST_TYPES];
+    LatencyRecorder service[NUM_REQUEST_TYPES];
+
+    WorkerGroup()
+        : sim(NULL), name(NULL), queue(NULL), shards(NULL), body(NULL),
+          coalesce(false), scalerGroup(-1), running(0), target(0),
+          closed(false), started(0), completed(0), mergedUpdates(0)
+    {
+        smutex_init(&mutex);
+    }
+    ~WorkerGroup() { smutex_destroy(&mutex); }
+};
+
+/*
+ * The outcomes of the purchases that carried a Completion, and the
+ * total time from their submission to their completion.
+ */
+struct PurchaseTally {
+    std::atomic<long> bought;
+    std::atomic<long> givenUp;
+    std::atomic<long long> totalNs;
+
+    PurchaseTally() : bought(0), givenUp(0), totalNs(0) { }
+};
 
 class Simulation {
     public:
+    const SimOptions opts;
+
     TaskQueue supplierTasks;
     TaskQueue customerTasks;
+    ShardedTaskQueue* customerShards;
     EStore store;
+    WorkStealingPool* pool;
+    ZipfDistribution* popularity;
+    WorkerGroup suppliers;
+    WorkerGroup customers;
+    PurchaseTally purchases;
+    Autoscaler* scaler;
+    std::atomic<bool> scaling;
 
     int maxTasks;
     int numSuppliers;
     int numCustomers;
 
-    explicit Simulation(bool useFineMode) : store(useFineMode) { }
+    explicit Simulation(const SimOptions& options)
+        : opts(options),
+          supplierTasks(options.queueKind),
+          customerTasks(options.coroutines ? MONITOR_QUEUE : options.queueKind),
+          customerShards(NULL),
+          store(options.storeMode, options.waitForOrders, options.numItems,
+                options.layout),
+          pool(NULL), popularity(NULL), scaler(NULL), scaling(false)
+    {
+        supplierTasks.setProfileName("supplierTasks");
+        customerTasks.setProfileName("customerTasks");
+    }
 };
 
+/*
+ * ------------------------------------------------------------------
+ * configureGenerator --
+ *
+ *      Apply the batching, arrival, item space and item popularity
+ *      options of sim to generator.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+configureGenerator(Simulation* sim, RequestGenerator* generator)
+{
+    generator->setBatchSize(sim->opts.batchSize);
+    generator->setArrivals(sim->opts.arrivals, sim->opts.arrivalRate);
+    generator->setItemSpace(sim->opts.numItems, sim->opts.sparseIds);
+    generator->setItemPopularity(sim->popularity);
+}
+
 /*
  * ------------------------------------------------------------------
  * supplierGenerator --
@@ -24,13 +258,22 @@ class Simulation {
  *      The supplier generator thread. The argument is a pointer to
  *      the shared Simulation object.
  *
- *      Enqueue arg->maxTasks requests to the supplier queue, then
- *      stop all supplier threads by enqueuing arg->numSuppliers
- *      stop requests.
+ *      Enqueue arg->maxTasks requests to the supplier queue. The
+ *      supplier threads are stopped by closing the queue once this
+ *      thread is done; see startSimulation.
  *
  *      Use a SupplierRequestGenerator to generate and enqueue
  *      requests.
  *
+ *      With a work-stealing pool, submit the requests to the pool
+ *      as priority tasks instead, since they may unblock waiting
+ *      customers.
+ *
+ *      The thread draws from random stream 0, so that a run with a
+ *      fixed --seed generates the same requests. When a trace is
+ *      recorded, so are the requests; when one is replayed, its
+ *      supplier requests are issued instead.
+ *
  *      This thread should exit when done.
  *
  * Results:
@@ -41,10 +284,54 @@ class Simulation {
 static void*
 supplierGenerator(void* arg)
 {
-    // TODO: Your code here.
+    Simulation* sim = static_cast<Simulation*>(arg);
+
+    sutil_random_stream(0);
+    TaskSink* sink = &sim->supplierTasks;
+    if (sim->pool)
+        sink = sim->pool->sink(PRIORITY_TASK);
+
+    if (sim->opts.replay) {
+        sim->opts.replay->enqueueTasks(SUPPLIER_STREAM, sink, &sim->store,
+                                       sim->opts.batchSize);
+    } else {
+        SupplierRequestGenerator generator(sink);
+        configureGenerator(sim, &generator);
+        generator.setTrace(sim->opts.record, SUPPLIER_STREAM);
+        generator.enqueueTasks(sim->maxTasks, &sim->store);
+    }
+
+    sthread_exit();
     return NULL; // Keep compiler happy.
 }
 
+/*
+ * ------------------------------------------------------------------
+ * tallyPurchase --
+ *
+ *      The completion callback of purchases: add the outcome to the
+ *      PurchaseTally context and delete the completion.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+tallyPurchase(Completion* completion, void* context)
+{
+    PurchaseTally* tally = static_cast<PurchaseTally*>(context);
+    const RequestOutcome& outcome = completion->result();
+
+    if (outcome.succeeded)
+        tally->bought.fetch_add(1, memory_order_relaxed);
+    else
+        tally->givenUp.fetch_add(1, memory_order_relaxed);
+    tally->totalNs.fetch_add(outcome.finishNs - outcome.submittedNs,
+                             memory_order_relaxed);
+    delete completion;
+}
+
 /*
  * ------------------------------------------------------------------
  * customerGenerator --
@@ -52,9 +339,9 @@ supplierGenerator(void* arg)
  *      The customer generator thread. The argument is a pointer to
  *      the shared Simulation object.
  *
- *      Enqueue arg->maxTasks requests to the customer queue, then
- *      stop all customer threads by enqueuing arg->numCustomers
- *      stop requests.
+ *      Enqueue arg->maxTasks requests to the customer queue. The
+ *      customer threads are stopped by closing the queue once this
+ *      thread is done; see startSimulation.
  *
  *      Use a CustomerRequestGenerator to generate and enqueue
  *      requests.  For the fineMode argument to the constructor
@@ -62,6 +349,13 @@ supplierGenerator(void* arg)
  *      store.fineModeEnabled() method, where store is a field
  *      in the Simulation class.
  *
+ *      With a work-stealing pool, submit the requests to the pool
+ *      as normal tasks instead.
+ *
+ *      The thread draws from random stream 1. Traces are recorded
+ *      and replayed as for supplierGenerator. With trackOutcomes,
+ *      generated purchases are tallied by tallyPurchase.
+ *
  *      This thread should exit when done.
  *
  * Results:
@@ -72,28 +366,160 @@ supplierGenerator(void* arg)
 static void*
 customerGenerator(void* arg)
 {
-    // TODO: Your code here.
+    Simulation* sim = static_cast<Simulation*>(arg);
+
+    sutil_random_stream(1);
+    TaskSink* sink = &sim->customerTasks;
+    if (sim->customerShards)
+        sink = sim->customerShards;
+    if (sim->pool)
+        sink = sim->pool->sink(NORMAL_TASK);
+
+    if (sim->opts.replay) {
+        sim->opts.replay->enqueueTasks(CUSTOMER_STREAM, sink, &sim->store,
+                                       sim->opts.batchSize);
+    } else {
+        CustomerRequestGenerator generator(sink,
+                                           sim->store.fineModeEnabled());
+        configureGenerator(sim, &generator);
+        generator.setTrace(sim->opts.record, CUSTOMER_STREAM);
+        if (sim->opts.trackOutcomes)
+            generator.setCompletions(tallyPurchase, &sim->purchases);
+        generator.enqueueTasks(sim->maxTasks, &sim->store);
+    }
+
+    sthread_exit();
     return NULL; // Keep compiler happy.
 }
 
+/*
+ * ------------------------------------------------------------------
+ * runTask --
+ *
+ *      Execute task on worker. For a request, record the time from
+ *      its issue to the start of its execution as queueing delay
+ *      and the time its handler took as service time.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+runTask(Worker* worker, const Task& task)
+{
+    int type = request_type(task.handler);
+    long long start = sthread_time_ns();
+
+    task.handler(task.arg);
+    worker->completed.fetch_add(1, memory_order_relaxed);
+
+    if (type < 0)
+        return;
+    if (task.issuedNs != 0)
+        worker->queueDelay[type].record(start - task.issuedNs);
+    worker->service[type].record(sthread_time_ns() - start);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * retire --
+ *
+ *      Decide whether worker should retire: whether its group has
+ *      more threads running than its target. A worker that retires
+ *      is no longer counted as running, and is marked retired so
+ *      that the next rescale joins it.
+ *
+ * Results:
+ *      True if the worker must exit.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+retire(Worker* worker)
+{
+    WorkerGroup* group = worker->group;
+    int running = group->running.load(memory_order_relaxed);
+    while (running > group->target.load(memory_order_relaxed)) {
+        if (group->running.compare_exchange_weak(running, running - 1)) {
+            worker->retired.store(true);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * runTasks --
+ *
+ *      Dequeue Tasks from the worker's queue and execute them,
+ *      batchSize at a time when batching is enabled, until the
+ *      queue is closed and drained or the worker retires.
+ *
+ *      If the worker has a coalescer, each batch goes through it
+ *      before it runs.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+runTasks(Worker* worker, int batchSize)
+{
+    TaskQueue* queue = worker->queue;
+    ShardedTaskQueue* shards = worker->shards;
+
+    if (batchSize == 1) {
+        while (!retire(worker)) {
+            Task task = shards ? shards->dequeue(worker->home)
+                               : queue->dequeue();
+            if (task.handler == NULL)
+                return;
+            runTask(worker, task);
+        }
+        return;
+    }
+
+    Task batch[MAX_TASK_BATCH];
+    while (!retire(worker)) {
+        int n = shards ? shards->dequeueUpTo(worker->home, batch, batchSize)
+                       : queue->dequeueUpTo(batch, batchSize);
+        if (n == 0)
+            return;
+        if (worker->coalescer)
+            n = worker->coalescer->coalesce(batch, n);
+        for (int i = 0; i < n; i++)
+            runTask(worker, batch[i]);
+    }
+}
+
 /*
  * ------------------------------------------------------------------
  * supplier --
  *
  *      The main supplier thread. The argument is a pointer to the
- *      shared Simulation object.
+ *      thread's Worker.
  *
- *      Dequeue Tasks from the supplier queue and execute them.
+ *      Dequeue Tasks from the supplier queue and execute them
+ *      until the queue is closed and drained or the thread retires,
+ *      then exit.
  *
  * Results:
- *      Does not return.
+ *      NULL.
  *
  * ------------------------------------------------------------------
  */
 static void*
 supplier(void* arg)
 {
-    // TODO: Your code here.
+    Worker* worker = static_cast<Worker*>(arg);
+
+    int batchSize = worker->sim->opts.batchSize;
+    if (worker->coalescer && batchSize < SIM_BATCH_SIZE)
+        batchSize = SIM_BATCH_SIZE;
+    runTasks(worker, batchSize);
     return NULL; // Keep compiler happy.
 }
 
@@ -102,22 +528,282 @@ supplier(void* arg)
  * customer --
  *
  *      The main customer thread. The argument is a pointer to the
- *      shared Simulation object.
+ *      thread's Worker.
  *
- *      Dequeue Tasks from the customer queue and execute them.
+ *      Dequeue Tasks from the customer queue and execute them
+ *      until the queue is closed and drained or the thread retires,
+ *      then exit.
  *
  * Results:
- *      Does not return.
+ *      NULL.
  *
  * ------------------------------------------------------------------
  */
 static void*
 customer(void* arg)
 {
-    // TODO: Your code here.
+    Worker* worker = static_cast<Worker*>(arg);
+
+    runTasks(worker, worker->sim->opts.batchSize);
     return NULL; // Keep compiler happy.
 }
 
+/*
+ * ------------------------------------------------------------------
+ * initGroup --
+ *
+ *      Set up group to run body on numWorkers threads serving
+ *      queue, or shards if it is not NULL. No thread is started.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+initGroup(WorkerGroup* group, Simulation* sim, const char* name,
+          TaskQueue* queue, ShardedTaskQueue* shards, void* (*body)(void*),
+          bool coalesce, int numWorkers)
+{
+    group->sim      = sim;
+    group->name     = name;
+    group->queue    = queue;
+    group->shards   = shards;
+    group->body     = body;
+    group->coalesce = coalesce;
+    group->target.store(numWorkers);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * startWorker --
+ *
+ *      Start one more thread in group, unless the group is closed.
+ *      Threads of a sharded group get their home shards in turn.
+ *
+ * Results:
+ *      True if a thread was started.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+startWorker(WorkerGroup* group)
+{
+    smutex_lock(&group->mutex);
+    if (group->closed) {
+        smutex_unlock(&group->mutex);
+        return false;
+    }
+
+    Worker* worker = new Worker();
+    worker->sim    = group->sim;
+    worker->group  = group;
+    worker->queue  = group->queue;
+    worker->shards = group->shards;
+    worker->completed.store(0);
+    worker->retired.store(false);
+    if (group->shards)
+        worker->home = group->started % group->shards->numShards();
+    if (group->coalesce)
+        worker->coalescer = new UpdateCoalescer();
+    group->workers.push_back(worker);
+    group->started++;
+    group->running.fetch_add(1);
+    sthread_create(&worker->thread, group->body, worker);
+    smutex_unlock(&group->mutex);
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * joinWorker --
+ *
+ *      Wait for the thread of worker, which has retired or whose
+ *      queue is closed, to exit, then add its tasks, latencies and
+ *      merged updates to its group's and free it. The caller holds
+ *      the group's mutex and removes the worker from workers.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+joinWorker(WorkerGroup* group, Worker* worker)
+{
+    sthread_join(worker->thread);
+
+    group->completed += worker->completed.load();
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+        group->queueDelay[t].merge(worker->queueDelay[t]);
+        group->service[t].merge(worker->service[t]);
+    }
+    if (worker->coalescer) {
+        group->mergedUpdates += worker->coalescer->mergedUpdates();
+        delete worker->coalescer;
+    }
+    delete worker;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * closeGroup --
+ *
+ *      Close the group and its queue, so that its threads finish
+ *      the queued tasks and exit, and join every thread it still
+ *      has.
+ *
+ * Results:
+ *      The number of tasks still queued when the queue closed.
+ *
+ * ------------------------------------------------------------------
+ */
+static int
+closeGroup(WorkerGroup* group)
+{
+    smutex_lock(&group->mutex);
+    group->closed = true;
+    smutex_unlock(&group->mutex);
+
+    int pending = group->shards ? group->shards->close()
+                                : group->queue->close();
+
+    smutex_lock(&group->mutex);
+    for (Worker* worker : group->workers)
+        joinWorker(group, worker);
+    group->workers.clear();
+    smutex_unlock(&group->mutex);
+    return pending;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * scaleGroup --
+ *
+ *      Join the threads of group that retired since the last call.
+ *      Then sample the group's queue depth and completed task
+ *      count; waiting is the number of its threads blocked in the
+ *      store. Let the autoscaler pick the group's thread count, and
+ *      start threads if it grew. Threads beyond the count retire by
+ *      themselves.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+scaleGroup(Simulation* sim, WorkerGroup* group, long waiting)
+{
+    long depth = group->shards ? group->shards->pending()
+                               : group->queue->pending();
+    long completed;
+
+    smutex_lock(&group->mutex);
+    bool closed = group->closed;
+    auto live = group->workers.begin();
+    for (Worker* worker : group->workers) {
+        if (worker->retired.load())
+            joinWorker(group, worker);
+        else
+            *live++ = worker;
+    }
+    group->workers.erase(live, group->workers.end());
+    completed = group->completed;
+    for (Worker* worker : group->workers)
+        completed += worker->completed.load(memory_order_relaxed);
+    smutex_unlock(&group->mutex);
+    if (closed)
+        return;
+
+    int target = sim->scaler->sample(group->scalerGroup, depth, waiting,
+                                     completed);
+    group->target.store(target);
+    while (group->running.load() < target && startWorker(group))
+        ;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * autoscaler --
+ *
+ *      The autoscaler thread. The argument is a pointer to the
+ *      shared Simulation object.
+ *
+ *      Every DEFAULT_SCALE_PERIOD_NS, rescale the supplier and the
+ *      customer threads. Only customers wait in the store, so the
+ *      waiting orders count against the customer threads, unless
+ *      they are coroutines that hold no thread while they wait.
+ *      Stops once sim->scaling is cleared.
+ *
+ * Results:
+ *      Does not return. Exit instead.
+ *
+ * ------------------------------------------------------------------
+ */
+static void*
+autoscaler(void* arg)
+{
+    Simulation* sim = static_cast<Simulation*>(arg);
+
+    while (sim->scaling.load()) {
+        sthread_sleep(0, DEFAULT_SCALE_PERIOD_NS);
+        scaleGroup(sim, &sim->suppliers, 0);
+        scaleGroup(sim, &sim->customers,
+                   sim->opts.coroutines ?
+                   0 : sim->store.getStats().waitingOrders.load());
+    }
+
+    sthread_exit();
+    return NULL; // Keep compiler happy.
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reportLatencies --
+ *
+ *      Print the queueing delay and service time percentiles of
+ *      every request type, merged over the closed groups and, with
+ *      --steal, over the workers of the shut down pool.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+reportLatencies(const vector<const WorkerGroup*>& groups,
+                const WorkStealingPool* pool)
+{
+    LatencyRecorder queueDelay[NUM_REQUEST_TYPES];
+    LatencyRecorder service[NUM_REQUEST_TYPES];
+    for (const WorkerGroup* group : groups) {
+        for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+            queueDelay[t].merge(group->queueDelay[t]);
+            service[t].merge(group->service[t]);
+        }
+    }
+    if (pool)
+        pool->mergeLatencies(queueDelay, service);
+
+    printf("%-16s %6s   %-26s   %-26s\n",
+           "", "", "queueing delay (us)", "service time (us)");
+    printf("%-16s %6s   %8s %8s %8s   %8s %8s %8s\n", "request", "count",
+           "p50", "p99", "p999", "p50", "p99", "p999");
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+        if (service[t].count() == 0)
+            continue;
+        printf("%-16s %6ld   %8.1f %8.1f %8.1f   %8.1f %8.1f %8.1f\n",
+               request_type_name(t), service[t].count(),
+               queueDelay[t].percentileNs(0.50) / 1e3,
+               queueDelay[t].percentileNs(0.99) / 1e3,
+               queueDelay[t].percentileNs(0.999) / 1e3,
+               service[t].percentileNs(0.50) / 1e3,
+               service[t].percentileNs(0.99) / 1e3,
+               service[t].percentileNs(0.999) / 1e3);
+    }
+}
+
 /*
  * ------------------------------------------------------------------
  * startSimulation --
@@ -134,6 +820,37 @@ customer(void* arg)
  *      should wait until all of them exit, at which point it
  *      should return.
  *
+ *      Each generator's queue is closed once the generator is
+ *      done, which lets the workers finish the tasks still queued
+ *      and then exit, and the number of tasks still pending at that
+ *      point is reported. Once every supplier has exited nothing can
+ *      change the store any more, so the store is closed to release
+ *      customers that are still waiting for their purchase.
+ *
+ *      With a work-stealing pool there are no supplier and customer
+ *      threads: the pool runs the requests, the store is closed once
+ *      every supplier request has run, and the pool is shut down
+ *      once the generators are done.
+ *
+ *      With autoscale, an autoscaler thread resizes the supplier
+ *      and customer threads from numSuppliers and numCustomers
+ *      within the bounds of opts until their queues close, and
+ *      every decision it made is reported.
+ *
+ *      With coroutines, purchases woken in the store are resumed
+ *      on the customer threads or the pool. The store is closed
+ *      before the customer queue, so the purchases it wakes are
+ *      still run.
+ *
+ *      With fillInventory, the store is filled with every item of
+ *      the catalog before any thread starts. A replayed trace fills
+ *      the store with the items it recorded instead.
+ *
+ *      Finally, report the throughput, the size of the inventory
+ *      and its memory per item, how waiting customers were woken
+ *      and, for supplier and customer threads, the queueing delay
+ *      and service time of each request type.
+ *
  *      Hint: Use sthread_join.
  *
  * Results:
@@ -142,23 +859,414 @@ customer(void* arg)
  * ------------------------------------------------------------------
  */
 static void
-startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMode)
+startSimulation(int numSuppliers, int numCustomers, int maxTasks,
+                const SimOptions& opts)
+{
+    Simulation* sim = new Simulation(opts);
+    sim->maxTasks     = maxTasks;
+    sim->numSuppliers = numSuppliers;
+    sim->numCustomers = numCustomers;
+    if (opts.zipfSkew > 0)
+        sim->popularity = new ZipfDistribution(opts.numItems, opts.zipfSkew);
+
+    if (opts.replay) {
+        opts.replay->fillStore(&sim->store);
+    } else if (opts.fillInventory) {
+        auto fillStart = chrono::steady_clock::now();
+        SupplierRequestGenerator filler(NULL);
+        configureGenerator(sim, &filler);
+        filler.setTrace(opts.record, FILL_STREAM);
+        filler.fillStore(&sim->store);
+        chrono::duration<double> fillTime =
+            chrono::steady_clock::now() - fillStart;
+        cout << "fill time (s):     " << fillTime.count() << endl;
+    }
+
+    sthread_t supplierGen, customerGen, scalerThread;
+    int supplierPending = 0;
+    int customerPending = 0;
+
+    long numTasks = 2L * maxTasks;
+    if (opts.replay)
+        numTasks = opts.replay->count(SUPPLIER_STREAM) +
+                   opts.replay->count(CUSTOMER_STREAM);
+    if (opts.record)
+        opts.record->start();
+    if (opts.replay)
+        opts.replay->start();
+
+    auto start = chrono::steady_clock::now();
+
+    if (opts.workStealing) {
+        // A blocked purchase holds its worker, so keep one worker for
+        // the supplier requests that every waiting purchase needs.
+        sim->pool = new WorkStealingPool(numSuppliers + numCustomers,
+                                         opts.coroutines ? 0 : 1,
+                                         request_type, NUM_REQUEST_TYPES);
+        if (opts.coroutines)
+            sim->store.enableCoroutines(sim->pool->sink(NORMAL_TASK));
+
+        sthread_create(&supplierGen, supplierGenerator, sim);
+        sthread_create(&customerGen, customerGenerator, sim);
+
+        sthread_join(supplierGen);
+        sim->pool->waitForIdle(PRIORITY_TASK);
+        sim->store.close();
+
+        sthread_join(customerGen);
+        sim->pool->shutdown();
+    } else {
+        if (opts.customerShards > 0)
+            sim->customerShards = new ShardedTaskQueue(
+                opts.customerShards, opts.shardPolicy,
+                opts.coroutines ? MONITOR_QUEUE : opts.queueKind);
+        if (opts.coroutines) {
+            if (sim->customerShards)
+                sim->store.enableCoroutines(sim->customerShards);
+            else
+                sim->store.enableCoroutines(&sim->customerTasks);
+        }
+        if (opts.autoscale) {
+            sim->scaler = new Autoscaler();
+            numSuppliers = max(opts.minWorkers,
+                               min(opts.maxWorkers, numSuppliers));
+            numCustomers = max(opts.minWorkers,
+                               min(opts.maxWorkers, numCustomers));
+        }
+        initGroup(&sim->suppliers, sim, "suppliers", &sim->supplierTasks,
+                  NULL, supplier, opts.coalesce, numSuppliers);
+        initGroup(&sim->customers, sim, "customers", &sim->customerTasks,
+                  sim->customerShards, customer, false, numCustomers);
+
+        sthread_create(&supplierGen, supplierGenerator, sim);
+        sthread_create(&customerGen, customerGenerator, sim);
+        for (int i = 0; i < numSuppliers; i++)
+            startWorker(&sim->suppliers);
+        for (int i = 0; i < numCustomers; i++)
+            startWorker(&sim->customers);
+        if (sim->scaler) {
+            sim->suppliers.scalerGroup = sim->scaler->addGroup(
+                "suppliers", opts.minWorkers, opts.maxWorkers, numSuppliers);
+            sim->customers.scalerGroup = sim->scaler->addGroup(
+                "customers", opts.minWorkers, opts.maxWorkers, numCustomers);
+            sim->scaling.store(true);
+            sthread_create(&scalerThread, autoscaler, sim);
+        }
+
+        sthread_join(supplierGen);
+        supplierPending = closeGroup(&sim->suppliers);
+        sim->store.close();
+
+        sthread_join(customerGen);
+        customerPending = closeGroup(&sim->customers);
+
+        if (sim->scaler) {
+            sim->scaling.store(false);
+            sthread_join(scalerThread);
+        }
+    }
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << "elapsed (s):       " << elapsed.count() << endl;
+    cout << "tasks/sec:         " << numTasks / elapsed.count() << endl;
+    if (!sim->pool) {
+        cout << "pending at close:  " << supplierPending << " supplier, "
+             << customerPending << " customer" << endl;
+    }
+
+    size_t numItems = sim->store.inventorySize();
+    cout << "inventory items:   " << numItems << endl;
+    cout << "inventory bytes:   " << sim->store.inventoryMemory() << endl;
+    cout << "bytes/item:        "
+         << (numItems ? (double) sim->store.inventoryMemory() / numItems : 0.0)
+         << endl;
+
+    const EStoreStats& stats = sim->store.getStats();
+    long changes = stats.stateChanges.load();
+    long wakeups = stats.wakeups.load();
+    cout << "state changes:     " << changes << endl;
+    cout << "wakeups:           " << wakeups << endl;
+    cout << "futile wakeups:    " << stats.futileWakeups.load() << endl;
+    cout << "wakeups/change:    "
+         << (changes ? (double) wakeups / changes : 0.0) << endl;
+    if (opts.coroutines) {
+        cout << "suspended buys:    " << stats.suspendedPurchases.load()
+             << endl;
+    }
+
+    if (sim->store.getMode() == OPTIMISTIC_MODE) {
+        long commits = stats.optimisticCommits.load();
+        long aborts = stats.optimisticAborts.load();
+        cout << "stm commits:       " << commits << endl;
+        cout << "stm aborts:        " << aborts << endl;
+        cout << "stm abort rate:    "
+             << (commits + aborts ? (double) aborts / (commits + aborts) : 0.0)
+             << endl;
+        cout << "stm fallbacks:     " << stats.optimisticFallbacks.load()
+             << endl;
+    }
+
+    if (opts.trackOutcomes) {
+        long bought = sim->purchases.bought.load();
+        long givenUp = sim->purchases.givenUp.load();
+        cout << "purchases bought:  " << bought << endl;
+        cout << "purchases failed:  " << givenUp << endl;
+        cout << "avg purchase (us): "
+             << (bought + givenUp ?
+                 sim->purchases.totalNs.load() / 1e3 / (bought + givenUp) : 0.0)
+             << endl;
+    }
+
+    if (sim->pool) {
+        const PoolStats& pstats = sim->pool->getStats();
+        cout << "pool executed:     " << pstats.executed.load() << endl;
+        cout << "pool steals:       " << pstats.steals.load() << endl;
+        cout << "pool steal misses: " << pstats.failedSteals.load() << endl;
+        cout << "pool sleeps:       " << pstats.sleeps.load() << endl;
+    }
+
+    if (opts.coalesce && !sim->pool) {
+        cout << "merged updates:    "
+             << sim->suppliers.mergedUpdates + sim->customers.mergedUpdates
+             << endl;
+    }
+
+    if (sim->customerShards) {
+        const ShardStats& sstats = sim->customerShards->getStats();
+        cout << "shard local:       " << sstats.localBatches.load() << endl;
+        cout << "shard steals:      " << sstats.stolenBatches.load() << endl;
+        cout << "shard sleeps:      " << sstats.sleeps.load() << endl;
+        delete sim->customerShards;
+    }
+
+    if (sim->scaler) {
+        cout << "threads started:   " << sim->suppliers.started
+             << " supplier, " << sim->customers.started
+             << " customer" << endl;
+        cout << "scaling decisions: " << sim->scaler->log().size() << endl;
+        sim->scaler->printLog(stdout);
+        delete sim->scaler;
+    }
+
+    reportLatencies({ &sim->suppliers, &sim->customers }, sim->pool);
+    delete sim->pool;
+    delete sim->popularity;
+    delete sim;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * parseArrivals --
+ *
+ *      Parse the name of an arrival process.
+ *
+ * Results:
+ *      True and the process in *kind, or false if arg is unknown.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+parseArrivals(const char* arg, ArrivalKind* kind)
 {
-    // TODO: Your code here.
+    if (strcmp(arg, "constant") == 0)
+        *kind = CONSTANT_ARRIVALS;
+    else if (strcmp(arg, "poisson") == 0)
+        *kind = POISSON_ARRIVALS;
+    else if (strcmp(arg, "bursty") == 0)
+        *kind = BURSTY_ARRIVALS;
+    else
+        return false;
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * parseThreadCounts --
+ *
+ *      Parse a comma-separated list of positive thread counts.
+ *
+ * Results:
+ *      True and the counts in *counts, or false if arg is malformed.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+parseThreadCounts(const char* arg, vector<int>* counts)
+{
+    counts->clear();
+    while (*arg) {
+        char* end;
+        long n = strtol(arg, &end, 10);
+        if (end == arg || n <= 0 || (*end != ',' && *end != '\0'))
+            return false;
+        counts->push_back(n);
+        arg = *end ? end + 1 : end;
+    }
+    return !counts->empty();
 }
 
 int main(int argc, char **argv)
 {
-    bool useFineMode = false;
+    SimOptions opts;
+    BenchOptions benchOpts;
+    bool bench = false;
+    bool layoutBench = false;
+    vector<int> bounds;
+    const char* recordPath = NULL;
+    const char* replayPath = NULL;
+    bool maxSpeed = false;
+
+    // Seed the random number generator. Use --seed to get deterministic
+    // requests.
+    sutil_srandom(time(NULL));
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fine") == 0) {
+            opts.storeMode = FINE_MODE;
+        } else if (strcmp(argv[i], "--stm") == 0) {
+            opts.storeMode = OPTIMISTIC_MODE;
+        } else if (strcmp(argv[i], "--wait") == 0) {
+            opts.waitForOrders = true;
+        } else if (strcmp(argv[i], "--ring") == 0) {
+            opts.queueKind = RING_QUEUE;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            opts.batchSize = SIM_BATCH_SIZE;
+        } else if (strcmp(argv[i], "--steal") == 0) {
+            opts.workStealing = true;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--bench-layout") == 0) {
+            layoutBench = true;
+        } else if (strcmp(argv[i], "--tasks") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0) {
+            opts.maxTasks = atoi(argv[++i]);
+            benchOpts.tasksPerClient = opts.maxTasks;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc &&
+                   parseThreadCounts(argv[i + 1], &benchOpts.threadCounts)) {
+            i++;
+        } else if (strcmp(argv[i], "--arrivals") == 0 && i + 1 < argc &&
+                   parseArrivals(argv[i + 1], &opts.arrivals)) {
+            i++;
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc &&
+                   atof(argv[i + 1]) > 0) {
+            opts.arrivalRate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            sutil_srandom(strtoul(argv[++i], NULL, 10));
+        } else if (strcmp(argv[i], "--zipf") == 0 && i + 1 < argc &&
+                   atof(argv[i + 1]) >= 0) {
+            opts.zipfSkew = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--items") == 0 && i + 1 < argc &&
+                   atol(argv[i + 1]) > 0 && atol(argv[i + 1]) <= INT_MAX) {
+            opts.numItems = atol(argv[++i]);
+            benchOpts.numItems = opts.numItems;
+        } else if (strcmp(argv[i], "--sparse") == 0) {
+            opts.sparseIds = true;
+            benchOpts.sparseIds = true;
+        } else if (strcmp(argv[i], "--fill") == 0) {
+            opts.fillInventory = true;
+        } else if (strcmp(argv[i], "--packed") == 0) {
+            opts.layout = PACKED_LAYOUT;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0) {
+            opts.customerShards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shard-by-item") == 0) {
+            opts.shardPolicy = HASH_SHARDS;
+        } else if (strcmp(argv[i], "--coalesce") == 0) {
+            opts.coalesce = true;
+        } else if (strcmp(argv[i], "--autoscale") == 0 && i + 1 < argc &&
+                   parseThreadCounts(argv[i + 1], &bounds) &&
+                   bounds.size() == 2 && bounds[0] <= bounds[1]) {
+            opts.autoscale  = true;
+            opts.minWorkers = bounds[0];
+            opts.maxWorkers = bounds[1];
+            i++;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (strcmp(argv[i], "--outcomes") == 0) {
+            opts.trackOutcomes = true;
+        } else if (strcmp(argv[i], "--coroutines") == 0) {
+            opts.coroutines = true;
+        } else if (strcmp(argv[i], "--max-speed") == 0) {
+            maxSpeed = true;
+        } else if (strcmp(argv[i], "--profile-locks") == 0) {
+            sthread_profile_enable();
+        } else {
+            cerr << "usage: " << argv[0]
+                 << " [--fine | --stm] [--wait] [--ring] [--batch] [--steal]"
+                 << " [--tasks N]" << endl
+                 << "       [--arrivals constant|poisson|bursty] [--rate R]"
+                 << " [--zipf S] [--seed N]" << endl
+                 << "       [--items N] [--sparse] [--fill] [--packed]"
+                 << " [--coalesce] [--profile-locks]" << endl
+                 << "       [--shards N [--shard-by-item]]"
+                 << " [--autoscale MIN,MAX] [--outcomes]" << endl
+                 << "       [--coroutines]"
+                 << " [--record FILE | --replay FILE [--max-speed]]"
+                 << endl
+                 << "       " << argv[0]
+                 << " --bench [--wait] [--tasks N] [--threads N,N,...]"
+                 << " [--items N] [--sparse]" << endl
+                 << "       " << argv[0]
+                 << " --bench-layout [--threads N,N,...]" << endl;
+            return 1;
+        }
+    }
+
+    // The benchmark sweeps both store modes and runs requests on
+    // its own client threads, so the simulation options other than
+    // --wait, --items and --sparse do not apply to it.
+    if (layoutBench) {
+        Benchmark(benchOpts).runLayouts();
+        return 0;
+    }
+    if (bench) {
+        benchOpts.waitForOrders = opts.waitForOrders;
+        Benchmark(benchOpts).run();
+        return 0;
+    }
+
+    // A trace is replayed into a store of the mode it was recorded
+    // for, since the customer requests of the two modes differ.
+    bool fineMode = opts.storeMode != COARSE_MODE;
+    TraceWriter recorder;
+    TraceReplayer replayer;
+    if (recordPath && replayPath) {
+        cerr << "--record and --replay cannot be combined" << endl;
+        return 1;
+    }
+    if (recordPath) {
+        if (!recorder.open(recordPath, fineMode)) {
+            perror(recordPath);
+            return 1;
+        }
+        opts.record = &recorder;
+    }
+    if (replayPath) {
+        if (!replayer.load(replayPath)) {
+            cerr << replayPath << ": cannot read trace" << endl;
+            return 1;
+        }
+        if (replayer.recordedInFineMode() != fineMode) {
+            cerr << replayPath << ": trace was recorded "
+                 << (fineMode ? "without" : "with")
+                 << " --fine or --stm" << endl;
+            return 1;
+        }
+        replayer.setMaxSpeed(maxSpeed);
+        opts.replay = &replayer;
+    }
 
-    // Seed the random number generator.
-    // You can remove this line or set it to some constant to get deterministic
-    // results, but make sure you put it back before turning in.
-    srand(time(NULL));
+    startSimulation(10, 10, opts.maxTasks, opts);
 
-    if (argc > 1)
-        useFineMode = strcmp(argv[1], "--fine") == 0;
-    startSimulation(10, 10, 100, useFineMode);
+    if (recordPath) {
+        if (!recorder.close()) {
+            cerr << recordPath << ": write failed" << endl;
+            return 1;
+        }
+        cout << "trace records:     " << recorder.recordCount() << endl;
+    }
     return 0;
 }
 
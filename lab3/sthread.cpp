@@ -4,26 +4,341 @@
 #include "sthread.h"
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <vector>
+#include <stdint.h>
 
 
 
+/*
+ * Lock profiling. Every profiled mutex and condition variable gets
+ * a record in a fixed open-addressing table keyed by its address;
+ * records are claimed with a compare-and-swap and never freed. A
+ * mutex's counters are only updated by the thread holding it, and
+ * a condition variable's by threads holding its mutex, so they need
+ * no further synchronization.
+ *
+ * pending counts the signals not yet consumed by a waiter: a wait
+ * that returns with one pending is a wakeup, any other return is
+ * spurious.
+ */
+#define SPROFILE_SLOTS       (1 << 18)
+#define SPROFILE_REPORT_ROWS 20
+
+struct sprofile_record
+{
+    std::atomic<const void *> object;
+    long long acquires;
+    long long contended;
+    long long wait_ns;
+    long long hold_ns;
+    long long locked_at;
+    long long waits;
+    long long signals;
+    long long broadcasts;
+    long long wakeups;
+    long long spurious;
+    long long waiters;
+    long long pending;
+};
+
+struct sprofile_name
+{
+    const char *first;
+    size_t count;
+    size_t stride;
+    const char *name;
+};
+
+static std::atomic<bool> sprofile_on(false);
+static sprofile_record *sprofile_table;
+static std::atomic<long> sprofile_dropped(0);
+static pthread_mutex_t sprofile_names_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<sprofile_name> *sprofile_names;
+
+static inline bool sprofiling()
+{
+    return sprofile_on.load(std::memory_order_relaxed);
+}
+
+/*
+ * Find or claim the record of object. Returns NULL, and counts the
+ * object as dropped, once the table is full.
+ */
+static sprofile_record *sprofile_find(const void *object)
+{
+    uintptr_t h = (uintptr_t) object;
+    h = (h >> 4) * 0x9e3779b97f4a7c15ULL;
+    for (size_t probe = 0; probe < SPROFILE_SLOTS; probe++)
+    {
+        sprofile_record *r =
+            &sprofile_table[(h + probe) & (SPROFILE_SLOTS - 1)];
+        const void *key = r->object.load(std::memory_order_acquire);
+        if (key == object)
+            return r;
+        if (key == NULL &&
+            (r->object.compare_exchange_strong(key, object) ||
+             key == object))
+            return r;
+    }
+    sprofile_dropped.fetch_add(1);
+    return NULL;
+}
+
+/*
+ * Format the name of the object at address into buf, or its address
+ * if it was never named. Later names take precedence.
+ */
+static void sprofile_format_name(const void *object, char *buf, size_t len)
+{
+    const char *p = (const char *) object;
+
+    pthread_mutex_lock(&sprofile_names_lock);
+    for (size_t i = sprofile_names ? sprofile_names->size() : 0; i > 0; i--)
+    {
+        const sprofile_name &n = (*sprofile_names)[i - 1];
+        if (p < n.first)
+            continue;
+        size_t offset = p - n.first;
+        size_t index = n.stride ? offset / n.stride : 0;
+        if (index >= n.count || offset != index * n.stride)
+            continue;
+        if (n.count == 1)
+            snprintf(buf, len, "%s", n.name);
+        else
+            snprintf(buf, len, "%s[%zu]", n.name, index);
+        pthread_mutex_unlock(&sprofile_names_lock);
+        return;
+    }
+    pthread_mutex_unlock(&sprofile_names_lock);
+    snprintf(buf, len, "%p", object);
+}
+
+/*
+ * Print the profile: the mutexes with the most wait time, then the
+ * condition variables with the most waits.
+ */
+static void sprofile_report()
+{
+    std::vector<const sprofile_record *> locks, conds;
+    for (size_t i = 0; i < SPROFILE_SLOTS; i++)
+    {
+        const sprofile_record *r = &sprofile_table[i];
+        if (r->object.load() == NULL)
+            continue;
+        if (r->acquires)
+            locks.push_back(r);
+        if (r->waits || r->signals || r->broadcasts)
+            conds.push_back(r);
+    }
+
+    std::sort(locks.begin(), locks.end(),
+              [](const sprofile_record *a, const sprofile_record *b) {
+                  return a->wait_ns != b->wait_ns ? a->wait_ns > b->wait_ns
+                                                  : a->acquires > b->acquires;
+              });
+    std::sort(conds.begin(), conds.end(),
+              [](const sprofile_record *a, const sprofile_record *b) {
+                  return a->waits > b->waits;
+              });
+
+    char name[64];
+    fprintf(stderr, "\nlock profile: %zu mutexes, by wait time\n",
+            locks.size());
+    fprintf(stderr, "%-28s %10s %10s %6s %10s %10s\n", "mutex",
+            "acquires", "contended", "%", "wait (ms)", "hold (ms)");
+    for (size_t i = 0; i < locks.size() && i < SPROFILE_REPORT_ROWS; i++)
+    {
+        const sprofile_record *r = locks[i];
+        sprofile_format_name(r->object.load(), name, sizeof(name));
+        fprintf(stderr, "%-28s %10lld %10lld %6.2f %10.3f %10.3f\n", name,
+                r->acquires, r->contended, 100.0 * r->contended / r->acquires,
+                r->wait_ns / 1e6, r->hold_ns / 1e6);
+    }
+
+    fprintf(stderr, "\ncondition variable profile: %zu, by waits\n",
+            conds.size());
+    fprintf(stderr, "%-28s %10s %10s %10s %10s %10s\n", "condition",
+            "waits", "signals", "broadcasts", "wakeups", "spurious");
+    for (size_t i = 0; i < conds.size() && i < SPROFILE_REPORT_ROWS; i++)
+    {
+        const sprofile_record *r = conds[i];
+        sprofile_format_name(r->object.load(), name, sizeof(name));
+        fprintf(stderr, "%-28s %10lld %10lld %10lld %10lld %10lld\n", name,
+                r->waits, r->signals, r->broadcasts, r->wakeups, r->spurious);
+    }
+
+    if (sprofile_dropped.load())
+        fprintf(stderr, "(%ld operations not profiled: table full)\n",
+                sprofile_dropped.load());
+}
+
+void sthread_profile_enable(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, [] {
+        sprofile_table = new sprofile_record[SPROFILE_SLOTS]();
+        atexit(sprofile_report);
+        sprofile_on.store(true);
+    });
+}
+
+void sthread_profile_name_array(const void *first, size_t count,
+                                size_t stride, const char *name)
+{
+    pthread_mutex_lock(&sprofile_names_lock);
+    if (sprofile_names == NULL)
+        sprofile_names = new std::vector<sprofile_name>();
+    sprofile_names->push_back(
+        sprofile_name{(const char *) first, count, stride, strdup(name)});
+    pthread_mutex_unlock(&sprofile_names_lock);
+}
+
+void sthread_profile_name(const void *object, const char *name)
+{
+    sthread_profile_name_array(object, 1, 0, name);
+}
+
+static struct sprofile_env
+{
+    sprofile_env()
+    {
+        const char *env = getenv("STHREAD_PROFILE");
+        if (env && *env && strcmp(env, "0") != 0)
+            sthread_profile_enable();
+    }
+} sprofile_env_init;
+
+
+
+/*
+ * Adaptive mutexes. A contended lock polls held up to a per-mutex
+ * limit of SMUTEX_MIN_SPINS plus twice the mutex's average spin
+ * count, at most SMUTEX_MAX_SPINS, pausing twice as long after each
+ * poll up to SMUTEX_MAX_BACKOFF pause instructions. The average is
+ * only updated by the thread that then holds the mutex.
+ */
+#define SMUTEX_MIN_SPINS   10
+#define SMUTEX_MAX_SPINS   100
+#define SMUTEX_MAX_BACKOFF 64
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+#ifdef STHREAD_ADAPTIVE_MUTEX
+
+static inline pthread_mutex_t *smutex_raw(smutex_t *mutex)
+{
+    return &mutex->mutex;
+}
+
+static inline void smutex_set_held(smutex_t *mutex, int held)
+{
+    __atomic_store_n(&mutex->held, held, __ATOMIC_RELAXED);
+}
+
+/*
+ * Spinning only helps if the holder can run meanwhile.
+ */
+static bool smutex_may_spin()
+{
+    static std::atomic<int> processors(0);
+    int n = processors.load(std::memory_order_relaxed);
+    if (n == 0)
+    {
+        n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        processors.store(n > 0 ? n : 1, std::memory_order_relaxed);
+    }
+    return n > 1;
+}
+
+/*
+ * Block until the mutex is ours, spinning first if it pays to.
+ */
+static int smutex_acquire(smutex_t *mutex)
+{
+    if (smutex_may_spin())
+    {
+        int limit = SMUTEX_MIN_SPINS + 2 * mutex->spins;
+        if (limit > SMUTEX_MAX_SPINS)
+            limit = SMUTEX_MAX_SPINS;
+
+        int backoff = 1;
+        for (int n = 1; n <= limit; n++)
+        {
+            for (int i = 0; i < backoff; i++)
+                cpu_relax();
+            if (backoff < SMUTEX_MAX_BACKOFF)
+                backoff <<= 1;
+            if (__atomic_load_n(&mutex->held, __ATOMIC_RELAXED))
+                continue;
+
+            int err = pthread_mutex_trylock(&mutex->mutex);
+            if (err == 0)
+            {
+                mutex->spins += (n - mutex->spins) / 8;
+                return 0;
+            }
+            if (err != EBUSY)
+                return err;
+        }
+    }
+
+    int err = pthread_mutex_lock(&mutex->mutex);
+    if (err == 0)
+        mutex->spins += (SMUTEX_MAX_SPINS - mutex->spins) / 8;
+    return err;
+}
+
+#else
+
+static inline pthread_mutex_t *smutex_raw(smutex_t *mutex)
+{
+    return mutex;
+}
+
+static inline void smutex_set_held(smutex_t *mutex __attribute__((unused)),
+                                   int held __attribute__((unused)))
+{
+}
+
+static inline int smutex_acquire(smutex_t *mutex)
+{
+    return pthread_mutex_lock(mutex);
+}
+
+#endif
+
 void smutex_init(smutex_t *mutex)
 {
-    if (pthread_mutex_init(mutex, NULL))
+    if (pthread_mutex_init(smutex_raw(mutex), NULL))
     {
         perror("pthread_mutex_init failed");
         exit(-1);
     }
+#ifdef STHREAD_ADAPTIVE_MUTEX
+    mutex->held = 0;
+    mutex->spins = 0;
+#endif
 }
 
 void smutex_destroy(smutex_t *mutex)
 {
-    if (pthread_mutex_destroy(mutex))
+    if (pthread_mutex_destroy(smutex_raw(mutex)))
     {
         perror("pthread_mutex_destroy failed");
         exit(-1);
@@ -32,16 +347,81 @@ void smutex_destroy(smutex_t *mutex)
 
 void smutex_lock(smutex_t *mutex)
 {
-    if (pthread_mutex_lock(mutex))
+    if (sprofiling())
+    {
+        long long start = 0;
+        int err = pthread_mutex_trylock(smutex_raw(mutex));
+        if (err == EBUSY)
+        {
+            start = sthread_time_ns();
+            err = smutex_acquire(mutex);
+        }
+        if (err)
+        {
+            perror("pthread_mutex_lock failed");
+            exit(-1);
+        }
+        smutex_set_held(mutex, 1);
+
+        sprofile_record *r = sprofile_find(mutex);
+        if (r)
+        {
+            r->locked_at = sthread_time_ns();
+            r->acquires++;
+            if (start)
+            {
+                r->contended++;
+                r->wait_ns += r->locked_at - start;
+            }
+        }
+        return;
+    }
+
+    if (smutex_acquire(mutex))
     {
         perror("pthread_mutex_lock failed");
         exit(-1);
     }
+    smutex_set_held(mutex, 1);
+}
+
+int smutex_trylock(smutex_t *mutex)
+{
+    int err = pthread_mutex_trylock(smutex_raw(mutex));
+    if (err == EBUSY)
+        return 0;
+    if (err)
+    {
+        perror("pthread_mutex_trylock failed");
+        exit(-1);
+    }
+    smutex_set_held(mutex, 1);
+    if (sprofiling())
+    {
+        sprofile_record *r = sprofile_find(mutex);
+        if (r)
+        {
+            r->locked_at = sthread_time_ns();
+            r->acquires++;
+        }
+    }
+    return 1;
 }
 
 void smutex_unlock(smutex_t *mutex)
 {
-    if (pthread_mutex_unlock(mutex))
+    if (sprofiling())
+    {
+        sprofile_record *r = sprofile_find(mutex);
+        if (r && r->locked_at)
+        {
+            r->hold_ns += sthread_time_ns() - r->locked_at;
+            r->locked_at = 0;
+        }
+    }
+
+    smutex_set_held(mutex, 0);
+    if (pthread_mutex_unlock(smutex_raw(mutex)))
     {
         perror("pthread_mutex_unlock failed");
         exit(-1);
@@ -74,6 +454,17 @@ void scond_signal(scond_t *cond, smutex_t *mutex __attribute__((unused)))
     // assert(mutex is held by this thread);
     //
 
+    if (sprofiling())
+    {
+        sprofile_record *r = sprofile_find(cond);
+        if (r)
+        {
+            r->signals++;
+            if (r->pending < r->waiters)
+                r->pending++;
+        }
+    }
+
     if (pthread_cond_signal(cond))
     {
         perror("pthread_cond_signal failed");
@@ -87,6 +478,16 @@ void scond_broadcast(scond_t *cond, smutex_t *mutex __attribute__((unused)))
     // assert(mutex is held by this thread);
     //
 
+    if (sprofiling())
+    {
+        sprofile_record *r = sprofile_find(cond);
+        if (r)
+        {
+            r->broadcasts++;
+            r->pending = r->waiters;
+        }
+    }
+
     if (pthread_cond_broadcast(cond))
     {
         perror("pthread_cond_broadcast failed");
@@ -100,11 +501,202 @@ void scond_wait(scond_t *cond, smutex_t *mutex)
     // assert(mutex is held by this thread);
     //
 
-    if (pthread_cond_wait(cond, mutex))
+    sprofile_record *m = NULL, *c = NULL;
+    if (sprofiling())
+    {
+        m = sprofile_find(mutex);
+        c = sprofile_find(cond);
+        if (m && m->locked_at)
+            m->hold_ns += sthread_time_ns() - m->locked_at;
+        if (c)
+        {
+            c->waits++;
+            c->waiters++;
+        }
+    }
+
+    smutex_set_held(mutex, 0);
+    if (pthread_cond_wait(cond, smutex_raw(mutex)))
     {
         perror("pthread_cond_wait failed");
         exit(-1);
     }
+    smutex_set_held(mutex, 1);
+
+    if (m)
+        m->locked_at = sthread_time_ns();
+    if (c)
+    {
+        c->waiters--;
+        if (c->pending > 0)
+        {
+            c->pending--;
+            c->wakeups++;
+        }
+        else
+            c->spurious++;
+    }
+}
+
+
+
+void srwlock_init(srwlock_t *lock, int preferWriters)
+{
+    pthread_rwlockattr_t attr;
+    if (pthread_rwlockattr_init(&attr))
+    {
+        perror("pthread_rwlockattr_init failed");
+        exit(-1);
+    }
+#ifdef __GLIBC__
+    if (preferWriters &&
+        pthread_rwlockattr_setkind_np(
+            &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP))
+    {
+        perror("pthread_rwlockattr_setkind_np failed");
+        exit(-1);
+    }
+#else
+    (void) preferWriters;
+#endif
+    if (pthread_rwlock_init(lock, &attr))
+    {
+        perror("pthread_rwlock_init failed");
+        exit(-1);
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
+
+void srwlock_destroy(srwlock_t *lock)
+{
+    if (pthread_rwlock_destroy(lock))
+    {
+        perror("pthread_rwlock_destroy failed");
+        exit(-1);
+    }
+}
+
+/*
+ * Record an acquire of a reader-writer lock that started waiting at
+ * start, or did not wait if start is 0. Readers may record at the
+ * same time, so the counters are updated atomically.
+ */
+static void sprofile_rwlock_acquired(srwlock_t *lock, long long start,
+                                     bool write)
+{
+    sprofile_record *r = sprofile_find(lock);
+    if (r == NULL)
+        return;
+
+    long long now = sthread_time_ns();
+    __atomic_fetch_add(&r->acquires, 1, __ATOMIC_RELAXED);
+    if (start)
+    {
+        __atomic_fetch_add(&r->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&r->wait_ns, now - start, __ATOMIC_RELAXED);
+    }
+    if (write)
+        r->locked_at = now;
+}
+
+/*
+ * Take lock for reading or writing, profiling the acquire if lock
+ * profiling is on.
+ */
+static void srwlock_acquire(srwlock_t *lock, bool write)
+{
+    int err;
+    if (sprofiling())
+    {
+        long long start = 0;
+        err = write ? pthread_rwlock_trywrlock(lock)
+                    : pthread_rwlock_tryrdlock(lock);
+        if (err == EBUSY)
+        {
+            start = sthread_time_ns();
+            err = write ? pthread_rwlock_wrlock(lock)
+                        : pthread_rwlock_rdlock(lock);
+        }
+        if (err == 0)
+            sprofile_rwlock_acquired(lock, start, write);
+    }
+    else
+        err = write ? pthread_rwlock_wrlock(lock) : pthread_rwlock_rdlock(lock);
+
+    if (err)
+    {
+        perror(write ? "pthread_rwlock_wrlock failed"
+                     : "pthread_rwlock_rdlock failed");
+        exit(-1);
+    }
+}
+
+void srwlock_rdlock(srwlock_t *lock)
+{
+    srwlock_acquire(lock, false);
+}
+
+void srwlock_wrlock(srwlock_t *lock)
+{
+    srwlock_acquire(lock, true);
+}
+
+int srwlock_tryrdlock(srwlock_t *lock)
+{
+    int err = pthread_rwlock_tryrdlock(lock);
+    if (err == EBUSY || err == EAGAIN)
+        return 0;
+    if (err)
+    {
+        perror("pthread_rwlock_tryrdlock failed");
+        exit(-1);
+    }
+    if (sprofiling())
+        sprofile_rwlock_acquired(lock, 0, false);
+    return 1;
+}
+
+int srwlock_trywrlock(srwlock_t *lock)
+{
+    int err = pthread_rwlock_trywrlock(lock);
+    if (err == EBUSY)
+        return 0;
+    if (err)
+    {
+        perror("pthread_rwlock_trywrlock failed");
+        exit(-1);
+    }
+    if (sprofiling())
+        sprofile_rwlock_acquired(lock, 0, true);
+    return 1;
+}
+
+void srwlock_rdunlock(srwlock_t *lock)
+{
+    if (pthread_rwlock_unlock(lock))
+    {
+        perror("pthread_rwlock_unlock failed");
+        exit(-1);
+    }
+}
+
+void srwlock_wrunlock(srwlock_t *lock)
+{
+    if (sprofiling())
+    {
+        sprofile_record *r = sprofile_find(lock);
+        if (r && r->locked_at)
+        {
+            r->hold_ns += sthread_time_ns() - r->locked_at;
+            r->locked_at = 0;
+        }
+    }
+
+    if (pthread_rwlock_unlock(lock))
+    {
+        perror("pthread_rwlock_unlock failed");
+        exit(-1);
+    }
 }
 
 
@@ -137,6 +729,11 @@ void sthread_exit(void)
     pthread_exit(NULL);
 }
 
+void sthread_yield(void)
+{
+    sched_yield();
+}
+
 void sthread_join(sthread_t thrd)
 {
     pthread_join(thrd, NULL);
@@ -169,26 +766,86 @@ void sthread_sleep(unsigned int seconds, unsigned int nanoseconds)
 
 
 
+long long sthread_time_ns(void)
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+    {
+        perror("clock_gettime failed");
+        exit(-1);
+    }
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+
 /*
- * random() in stdlib.h is not MT-safe, so we need to lock
- * it.
+ * Per-thread xoshiro256** generators. Every thread's state is
+ * derived with splitmix64 from the shared seed and the thread's
+ * stream number. Streams a thread is given automatically start at
+ * SUTIL_AUTO_STREAM so they never collide with explicit ones.
  */
-pthread_mutex_t sulock = PTHREAD_MUTEX_INITIALIZER;
+#define SUTIL_AUTO_STREAM (1ULL << 32)
+
+struct sutil_state
+{
+    uint64_t s[4];
+    bool seeded;
+};
+
+static thread_local sutil_state sustate;
+static std::atomic<uint64_t> suseed(0x853c49e6748fea9bULL);
+static std::atomic<uint64_t> sunext_stream(SUTIL_AUTO_STREAM);
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static void sutil_seed_state(uint64_t seed, uint64_t stream)
+{
+    uint64_t x = seed ^ splitmix64(&stream);
+    for (int i = 0; i < 4; i++)
+        sustate.s[i] = splitmix64(&x);
+    sustate.seeded = true;
+}
 
 long sutil_random()
 {
-    long val;
+    if (!sustate.seeded)
+        sutil_seed_state(suseed.load(), sunext_stream.fetch_add(1));
 
-    if (pthread_mutex_lock(&sulock))
-    {
-        perror("random lock");
-        exit(-1);
-    }
-    val = random();
-    if (pthread_mutex_unlock(&sulock))
-    {
-        perror("random unlock");
-        exit(-1);
-    }
-    return val;
+    uint64_t *s = sustate.s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result >> 33;
+}
+
+void sutil_srandom(unsigned long seed)
+{
+    suseed.store(seed);
+    sunext_stream.store(SUTIL_AUTO_STREAM + 1);
+    sutil_seed_state(seed, SUTIL_AUTO_STREAM);
+}
+
+void sutil_random_stream(unsigned long stream)
+{
+    assert(stream < SUTIL_AUTO_STREAM);
+    sutil_seed_state(suseed.load(), stream);
 }
@@ -9,9 +9,38 @@ nanosleep}.
 */
 
 #include <pthread.h>
+#include <stddef.h>
 #include <unistd.h>
 
+/*
+ * Size of a cache line on the machines we run on. Used to pad
+ * structures that different threads write concurrently so that
+ * they do not false-share.
+ */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Building with STHREAD_ADAPTIVE_MUTEX defined (make ADAPTIVE_MUTEX=1)
+ * makes smutex_t an adaptive mutex. A thread that finds it locked
+ * spins for a bounded time, with exponential backoff, before it
+ * parks in the kernel, since most critical sections end long before
+ * a sleep and wakeup would. Each mutex adapts how long it spins to
+ * how long its recent acquires had to spin. On a machine with a
+ * single processor the holder cannot run while another thread
+ * spins, so the mutex always parks at once.
+ *
+ * held is set while the mutex is locked so that spinners can poll
+ * it without writing to the mutex's cache line.
+ */
+#ifdef STHREAD_ADAPTIVE_MUTEX
+typedef struct {
+    pthread_mutex_t mutex;
+    int held;
+    int spins;
+} smutex_t;
+#else
 typedef pthread_mutex_t smutex_t;
+#endif
 typedef pthread_cond_t scond_t;
 typedef pthread_t sthread_t;
 
@@ -20,6 +49,12 @@ void smutex_destroy(smutex_t *mutex);
 void smutex_lock(smutex_t *mutex);
 void smutex_unlock(smutex_t *mutex);
 
+/*
+ * Acquire the mutex only if it is free. Returns nonzero if the
+ * mutex was acquired and 0 if another thread holds it.
+ */
+int smutex_trylock(smutex_t *mutex);
+
 void scond_init(scond_t *cond);
 void scond_destroy(scond_t *cond);
 
@@ -36,12 +71,46 @@ void scond_broadcast(scond_t *cond, smutex_t *mutex);
 void scond_wait(scond_t *cond, smutex_t *mutex);
 
 
+/*
+ * Reader-writer locks. Any number of readers may hold the lock at
+ * once, or a single writer. A lock initialized with preferWriters
+ * set admits no new readers while a writer is waiting, so that a
+ * steady stream of readers cannot starve writers; a thread must
+ * then not take a read lock it already holds. Otherwise readers
+ * may overtake waiting writers.
+ *
+ * Under lock profiling a reader-writer lock reports its read and
+ * write acquires together, and only the write locks' hold time.
+ */
+typedef pthread_rwlock_t srwlock_t;
+
+void srwlock_init(srwlock_t *lock, int preferWriters);
+void srwlock_destroy(srwlock_t *lock);
+void srwlock_rdlock(srwlock_t *lock);
+void srwlock_wrlock(srwlock_t *lock);
+void srwlock_rdunlock(srwlock_t *lock);
+void srwlock_wrunlock(srwlock_t *lock);
+
+/*
+ * Acquire the lock only if it can be had without waiting. Return
+ * nonzero if it was acquired.
+ */
+int srwlock_tryrdlock(srwlock_t *lock);
+int srwlock_trywrlock(srwlock_t *lock);
+
+
 
 void sthread_create(sthread_t *thrd,
                     void *(start_routine(void*)), 
                     void *argToStartRoutine);
 void sthread_exit(void);
 
+/*
+ * Give up the processor to another runnable thread, if any. Only
+ * for backing off in short spin loops.
+ */
+void sthread_yield(void);
+
 /*
  * Block until the specified thread exits. If the thread has
  * already exited, this function returns immediately.
@@ -60,12 +129,52 @@ void sthread_join(sthread_t thrd);
  */
 void sthread_sleep(unsigned int seconds, unsigned int nanoseconds);
 
+/*
+ * Nanoseconds on a monotonic clock, for timestamps and intervals.
+ */
+long long sthread_time_ns(void);
+
+
+/*
+ * Lock profiling. Once sthread_profile_enable has been called, or
+ * from the start if the STHREAD_PROFILE environment variable is
+ * set, every mutex records its acquires, contended acquires and
+ * the total time threads waited for it and held it, and every
+ * condition variable records its waits, signals, broadcasts and
+ * the wakeups that did and did not follow a signal (spurious
+ * wakeups). A report sorted by lock wait time is printed to stderr
+ * when the program exits. Profiling is off by default and then
+ * costs one flag test per call.
+ *
+ * Objects are identified by address. sthread_profile_name gives an
+ * object a name for the report, and sthread_profile_name_array
+ * names count objects stride bytes apart, which are reported as
+ * name[index]. Names are copied, and kept even while profiling is
+ * off.
+ */
+void sthread_profile_enable(void);
+void sthread_profile_name(const void *object, const char *name);
+void sthread_profile_name_array(const void *first, size_t count,
+                                size_t stride, const char *name);
+
 
 /*
- * The normal random() library is not thread safe,
- * so we add a wrapper with locks.
+ * The normal random() library is not thread safe, and a lock
+ * around it serializes every caller, so each thread gets its own
+ * xoshiro256** generator instead. sutil_random returns values in
+ * [0, RAND_MAX], like random().
+ *
+ * sutil_srandom sets the seed of all generators and restarts the
+ * calling thread's generator. A thread that has not picked a
+ * stream is given the next unused one the first time it calls
+ * sutil_random, which depends on the order threads start drawing.
+ * For reproducible runs, a thread calls sutil_random_stream with a
+ * fixed stream number before drawing: the same seed and stream
+ * always give the same sequence.
  */
 long sutil_random(void);
+void sutil_srandom(unsigned long seed);
+void sutil_random_stream(unsigned long stream);
 
 #endif
 